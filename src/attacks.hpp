@@ -96,3 +96,59 @@ static inline bb get_queen_attacks(int square, bb occupancy) {
             get_rook_attacks(square, occupancy).get_board());
 }
 
+
+// between_masks[a][b]: squares strictly between a and b when they share a
+// rank, file or diagonal, empty otherwise.
+constexpr std::array<std::array<uint64_t, 64>, 64> generate_between_table() {
+  std::array<std::array<uint64_t, 64>, 64> table{};
+  constexpr int dirs[8][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}, {1, 1}, {1, -1}, {-1, 1}, {-1, -1}};
+
+  for (int from = 0; from < 64; from++) {
+    for (const auto& dir : dirs) {
+      uint64_t ray = 0;
+      int r = from / 8 + dir[0];
+      int f = from % 8 + dir[1];
+      while (r >= 0 && r < 8 && f >= 0 && f < 8) {
+        table[from][r * 8 + f] = ray;
+        ray |= square_bb(r * 8 + f);
+        r += dir[0];
+        f += dir[1];
+      }
+    }
+  }
+  return table;
+}
+
+constexpr std::array<std::array<uint64_t, 64>, 64> between_masks = generate_between_table();
+
+// line_masks[a][b]: the whole rank, file or diagonal through a and b (both
+// included), empty when they are not aligned.
+constexpr std::array<std::array<uint64_t, 64>, 64> generate_line_table() {
+  std::array<std::array<uint64_t, 64>, 64> table{};
+  constexpr int dirs[4][2] = {{1, 0}, {0, 1}, {1, 1}, {1, -1}};
+
+  for (int from = 0; from < 64; from++) {
+    for (const auto& dir : dirs) {
+      uint64_t line = square_bb(from);
+      for (int sign = -1; sign <= 1; sign += 2) {
+        int r = from / 8 + sign * dir[0];
+        int f = from % 8 + sign * dir[1];
+        while (r >= 0 && r < 8 && f >= 0 && f < 8) {
+          line |= square_bb(r * 8 + f);
+          r += sign * dir[0];
+          f += sign * dir[1];
+        }
+      }
+
+      uint64_t squares = line & ~square_bb(from);
+      while (squares) {
+        const int to = __builtin_ctzll(squares);
+        squares &= squares - 1;
+        table[from][to] = line;
+      }
+    }
+  }
+  return table;
+}
+
+constexpr std::array<std::array<uint64_t, 64>, 64> line_masks = generate_line_table();
@@ -63,12 +63,15 @@ std::string sq_to_string(int square) {
 void Board::reset() {
   piece_location.fill(bb{0});
   occupancies.fill(bb{0});
+  mailbox.fill(NO_PIECE);
   side = Side::white;
   enpassant = {false, -1};
   castling = 0;
   hash_key = bb{0};
   rep_idx = 0;
   fifty = 0;
+  checkers = 0;
+  pinned = 0;
 }
 
 uint64_t Board::generate_hash_key() {
@@ -124,9 +127,7 @@ void Board::load_fen(const std::string& fen) {
     const int square = get_square(rank, file);
     const int piece_idx = char_to_piece_idx(c);
 
-    piece_location[piece_idx].set_bit(square);
-    occupancies[piece_idx / NUMBER_OF_UNIQUE_PIECES].set_bit(square);
-    occupancies[static_cast<int>(Side::any)].set_bit(square);
+    put_piece(piece_idx, square);
 
     file++;
   }
@@ -149,14 +150,16 @@ void Board::load_fen(const std::string& fen) {
   if (en_passant_section == "-") {
     enpassant = {false, -1};
   } else {
-    const uint32_t rank = en_passant_section[1] - '1';
-    const uint32_t file = en_passant_section[0] - 'a';
-    enpassant = {true, TOTAL_SQUARES - get_square(rank, file)};
+    const int rank = BOARD_SIZE - (en_passant_section[1] - '0');
+    const int file = en_passant_section[0] - 'a';
+    enpassant = {true, get_square(rank, file)};
   }
 
   hash_key = bb(generate_hash_key());
 
   fifty = std::stoi(fifty_section);
+
+  update_check_info();
 }
 
 bool Board::is_sq_attacked(int square, Side attacking_side) const {
@@ -196,6 +199,138 @@ bool Board::is_sq_attacked(int square, Side attacking_side) const {
   return false;
 }
 
+// Recomputes checkers and pinned pieces for the side to move. Called once
+// per position so move generation and legality tests can share them.
+void Board::update_check_info() {
+  const Side enemy_side = opposite_side(side);
+  const int king_sq = piece_location[get_piece_index(PieceType::king, side)].get_lsb_index();
+  const uint64_t occupied = occupancies[static_cast<int>(Side::any)].get_board();
+  const uint64_t enemy_queens = piece_location[get_piece_index(PieceType::queen, enemy_side)].get_board();
+
+  checkers = attackers_to(king_sq, occupied) & occupancies[static_cast<int>(enemy_side)].get_board();
+  pinned = 0;
+
+  uint64_t snipers =
+      (get_rook_attacks(king_sq, bb()).get_board()
+         & (piece_location[get_piece_index(PieceType::rook, enemy_side)].get_board() | enemy_queens))
+    | (get_bishop_attacks(king_sq, bb()).get_board()
+         & (piece_location[get_piece_index(PieceType::bishop, enemy_side)].get_board() | enemy_queens));
+
+  while (snipers) {
+    const int sniper_sq = __builtin_ctzll(snipers);
+    snipers &= snipers - 1;
+
+    const uint64_t blockers = between_masks[king_sq][sniper_sq] & occupied;
+    if (blockers && !(blockers & (blockers - 1))) {
+      pinned |= blockers & occupancies[static_cast<int>(side)].get_board();
+    }
+  }
+}
+
+uint64_t Board::attackers_to(int sq, uint64_t occupancy) const {
+  const bb occupied(occupancy);
+  const uint64_t diagonal = piece_location[get_piece_index(PieceType::bishop, Side::white)].get_board()
+                          | piece_location[get_piece_index(PieceType::bishop, Side::black)].get_board()
+                          | piece_location[get_piece_index(PieceType::queen, Side::white)].get_board()
+                          | piece_location[get_piece_index(PieceType::queen, Side::black)].get_board();
+  const uint64_t straight = piece_location[get_piece_index(PieceType::rook, Side::white)].get_board()
+                          | piece_location[get_piece_index(PieceType::rook, Side::black)].get_board()
+                          | piece_location[get_piece_index(PieceType::queen, Side::white)].get_board()
+                          | piece_location[get_piece_index(PieceType::queen, Side::black)].get_board();
+
+  return (pawn_masks[static_cast<int>(Side::black)][sq].get_board()
+            & piece_location[get_piece_index(PieceType::pawn, Side::white)].get_board())
+       | (pawn_masks[static_cast<int>(Side::white)][sq].get_board()
+            & piece_location[get_piece_index(PieceType::pawn, Side::black)].get_board())
+       | (knight_masks[sq].get_board()
+            & (piece_location[get_piece_index(PieceType::knight, Side::white)].get_board()
+             | piece_location[get_piece_index(PieceType::knight, Side::black)].get_board()))
+       | (king_masks[sq].get_board()
+            & (piece_location[get_piece_index(PieceType::king, Side::white)].get_board()
+             | piece_location[get_piece_index(PieceType::king, Side::black)].get_board()))
+       | (get_bishop_attacks(sq, occupied).get_board() & diagonal)
+       | (get_rook_attacks(sq, occupied).get_board() & straight);
+}
+
+// Static exchange evaluation: does the capture sequence started by `move` on
+// its target square win at least `threshold` for the side to move? Pins are
+// ignored; castling, en passant and promotions count as an even trade.
+bool Board::see_ge(Move move, int threshold) const {
+  if (move.is_castle() || move.is_enpassant() || move.is_promo()) {
+    return 0 >= threshold;
+  }
+
+  const int from_sq = move.get_from_sq();
+  const int to_sq = move.get_to_sq();
+
+  const int victim = piece_on(to_sq);
+  int swap = (victim == NO_PIECE ? 0 : piece_values[victim % NUMBER_OF_UNIQUE_PIECES]) - threshold;
+  if (swap < 0) {
+    return false;
+  }
+
+  swap = piece_values[static_cast<int>(move.get_piece())] - swap;
+  if (swap <= 0) {
+    return true;
+  }
+
+  uint64_t occupied = occupancies[static_cast<int>(Side::any)].get_board() ^ square_bb(from_sq) ^ square_bb(to_sq);
+  uint64_t attackers = attackers_to(to_sq, occupied);
+  Side stm = side;
+  bool result = true;
+
+  const auto pieces_of = [this](PieceType piece) {
+    return piece_location[get_piece_index(piece, Side::white)].get_board()
+         | piece_location[get_piece_index(piece, Side::black)].get_board();
+  };
+  const uint64_t diagonal = pieces_of(PieceType::bishop) | pieces_of(PieceType::queen);
+  const uint64_t straight = pieces_of(PieceType::rook) | pieces_of(PieceType::queen);
+
+  while (true) {
+    stm = opposite_side(stm);
+    attackers &= occupied;
+
+    const uint64_t stm_attackers = attackers & occupancies[static_cast<int>(stm)].get_board();
+    if (!stm_attackers) {
+      break;
+    }
+
+    result = !result;
+
+    // Capture with the least valuable attacker and uncover any x-ray behind it.
+    int piece = 0;
+    uint64_t least_valuable = 0;
+    for (; piece < NUMBER_OF_UNIQUE_PIECES; piece++) {
+      least_valuable = stm_attackers & piece_location[piece + NUMBER_OF_UNIQUE_PIECES * static_cast<int>(stm)].get_board();
+      if (least_valuable) {
+        break;
+      }
+    }
+
+    if (piece == static_cast<int>(PieceType::king)) {
+      // The king may only recapture if the opponent has nothing left to attack with.
+      return (attackers & ~occupancies[static_cast<int>(stm)].get_board()) ? !result : result;
+    }
+
+    swap = piece_values[piece] - swap;
+    if (swap < static_cast<int>(result)) {
+      break;
+    }
+
+    occupied ^= least_valuable & -least_valuable;
+
+    if (piece == static_cast<int>(PieceType::pawn) || piece == static_cast<int>(PieceType::bishop) ||
+        piece == static_cast<int>(PieceType::queen)) {
+      attackers |= get_bishop_attacks(to_sq, bb(occupied)).get_board() & diagonal;
+    }
+    if (piece == static_cast<int>(PieceType::rook) || piece == static_cast<int>(PieceType::queen)) {
+      attackers |= get_rook_attacks(to_sq, bb(occupied)).get_board() & straight;
+    }
+  }
+
+  return result;
+}
+
 void Board::print() const {
   std::cout << "\n";
 
@@ -207,15 +342,8 @@ void Board::print() const {
         std::cout << "  " << BOARD_SIZE - rank << " ";
       }
 
-      int piece = -1;
-      for (int piece_type = 0; piece_type < NUMBER_OF_PIECES; piece_type++) {
-        if (piece_location[piece_type].get_bit(square)) {
-          piece = piece_type;
-          break;
-        }
-      }
-
-      std::cout << " " << (piece == -1 ? '.' : PIECE_SYMBOLS[piece]);
+      const int piece = mailbox[square];
+      std::cout << " " << (piece == NO_PIECE ? '.' : PIECE_SYMBOLS[piece]);
     }
     std::cout << "\n";
   }
@@ -229,7 +357,7 @@ void Board::print() const {
     int ep_rank = ep_square / BOARD_SIZE;
     int ep_file = ep_square % BOARD_SIZE;
     char file_char = 'a' + ep_file;
-    char rank_char = '1' + ep_rank;
+    char rank_char = '8' - ep_rank;
     std::cout << file_char << rank_char << "\n";
   } else {
     std::cout << "no\n";
@@ -261,37 +389,40 @@ void Board::print_insides() {
   }
 }
 
+// put_piece/remove_piece only touch the bitboards; unmake_move relies on
+// that and restores the hash key from the saved state instead.
+void Board::put_piece(int piece_idx, int sq) {
+  const int piece_side = piece_idx / NUMBER_OF_UNIQUE_PIECES;
+
+  piece_location[piece_idx].set_bit(sq);
+  occupancies[piece_side].set_bit(sq);
+  occupancies[static_cast<int>(Side::any)].set_bit(sq);
+  mailbox[sq] = piece_idx;
+}
+
+void Board::remove_piece(int piece_idx, int sq) {
+  const int piece_side = piece_idx / NUMBER_OF_UNIQUE_PIECES;
+
+  piece_location[piece_idx].pop_bit(sq);
+  occupancies[piece_side].pop_bit(sq);
+  occupancies[static_cast<int>(Side::any)].pop_bit(sq);
+  mailbox[sq] = NO_PIECE;
+}
+
 void Board::move_piece(int piece_idx, int from_sq, int to_sq) {
-  piece_location[piece_idx].pop_bit(from_sq);
-  piece_location[piece_idx].set_bit(to_sq);
+  remove_piece(piece_idx, from_sq);
+  put_piece(piece_idx, to_sq);
 
   hash_key ^= zobrist_table.piece_keys[piece_idx][from_sq];
   hash_key ^= zobrist_table.piece_keys[piece_idx][to_sq];
-  
-  // Update occupancies - determine which side this piece belongs to
-  Side piece_side = (piece_idx < NUMBER_OF_UNIQUE_PIECES) ? Side::white : Side::black;
-  
-  occupancies[static_cast<int>(piece_side)].pop_bit(from_sq);
-  occupancies[static_cast<int>(piece_side)].set_bit(to_sq);
-  occupancies[static_cast<int>(Side::any)].pop_bit(from_sq);
-  occupancies[static_cast<int>(Side::any)].set_bit(to_sq);
 }
 
-void Board::pop_piece(int sq, Side side) {
-  const int start_idx = static_cast<int>(side) * NUMBER_OF_UNIQUE_PIECES;
-  const int end_idx = start_idx + NUMBER_OF_UNIQUE_PIECES;
-
-  for (int idx = start_idx; idx < end_idx; ++idx) {
-    bb& bitboard = piece_location[idx];
-    if (bitboard.get_bit(sq)) {
-      bitboard.pop_bit(sq);
-      hash_key ^= zobrist_table.piece_keys[idx][sq];
-      
-      occupancies[static_cast<int>(side)].pop_bit(sq);
-      occupancies[static_cast<int>(Side::any)].pop_bit(sq);
-      return;
-    }
-  }
+int Board::pop_piece(int sq) {
+  const int idx = mailbox[sq];
+
+  remove_piece(idx, sq);
+  hash_key ^= zobrist_table.piece_keys[idx][sq];
+  return idx;
 }
 
 const int castling_rights[64] = {
@@ -305,80 +436,107 @@ const int castling_rights[64] = {
   13, 15, 15, 15, 12, 15, 15, 14
 };
 
-bool Board::make_move(Move move) {
-  Board board_cpy(*this);
+static int castling_rook_from(int king_to_sq) {
+  return (king_to_sq % 8 == 6) ? king_to_sq + 1 : king_to_sq - 2;
+}
 
-  const Side moving_side = move.get_side_of_piece();
-  const Side opposite_side_val = opposite_side(moving_side);
+static int castling_rook_to(int king_to_sq) {
+  return (king_to_sq % 8 == 6) ? king_to_sq - 1 : king_to_sq + 1;
+}
+
+// Mirrors the key updates of make_move, so the search can start loading the
+// child's table entry before the move is played.
+uint64_t Board::key_after(Move move) const {
   const uint32_t from_sq = move.get_from_sq();
   const uint32_t to_sq = move.get_to_sq();
-  const int piece_idx = static_cast<int>(move.get_piece()) + NUMBER_OF_UNIQUE_PIECES * static_cast<int>(moving_side);
+  const int piece_idx = get_piece_index(move.get_piece(), side);
+  const int landing_idx = move.is_promo() ? get_piece_index(move.get_prom_piece(), side) : piece_idx;
 
-  bool is_pawn_move = move.get_piece() == PieceType::pawn;
-  bool resets_fifty_counter = is_pawn_move || move.is_capture();
+  uint64_t key = hash_key.get_board() ^ zobrist_table.side_key;
+  key ^= zobrist_table.piece_keys[piece_idx][from_sq];
+  key ^= zobrist_table.piece_keys[landing_idx][to_sq];
 
-  if (move.is_capture() && move.is_enpassant()) {
-    const int captured_pawn_sq = to_sq + 8 - 16 * static_cast<int>(moving_side);
+  if (move.is_capture()) {
+    const int captured_sq = move.is_enpassant() ? to_sq + 8 - 16 * static_cast<int>(side) : to_sq;
+    key ^= zobrist_table.piece_keys[mailbox[captured_sq]][captured_sq];
+  }
 
-    pop_piece(captured_pawn_sq, opposite_side_val);
-    occupancies[static_cast<int>(opposite_side_val)].pop_bit(captured_pawn_sq);
-    occupancies[static_cast<int>(Side::any)].pop_bit(captured_pawn_sq);
+  if (move.is_castle()) {
+    const int rook_idx = get_piece_index(PieceType::rook, side);
+    key ^= zobrist_table.piece_keys[rook_idx][castling_rook_from(to_sq)];
+    key ^= zobrist_table.piece_keys[rook_idx][castling_rook_to(to_sq)];
   }
 
-  if (move.is_capture() && !move.is_enpassant()) {
+  if (enpassant.first) {
+    key ^= zobrist_table.enp_keys[enpassant.second];
+  }
 
-    occupancies[static_cast<int>(opposite_side_val)].pop_bit(to_sq);
-    occupancies[static_cast<int>(Side::any)].pop_bit(to_sq);
-    
-    pop_piece(to_sq, opposite_side_val);
+  if (move.is_double_pawn()) {
+    key ^= zobrist_table.enp_keys[to_sq + 8 - 16 * static_cast<int>(side)];
   }
 
-  piece_location[piece_idx].pop_bit(from_sq);
-  piece_location[piece_idx].set_bit(to_sq);
+  key ^= zobrist_table.castle_keys[castling];
+  key ^= zobrist_table.castle_keys[castling & castling_rights[from_sq] & castling_rights[to_sq]];
+  return key;
+}
+
+// Plays a legal move, as produced by the move generator or checked with
+// is_legal(), and saves what unmake_move needs into `state`.
+void Board::make_move(Move move, StateInfo& state) {
+  state.captured_piece = NO_PIECE;
+  state.castling = castling;
+  state.enpassant = enpassant;
+  state.fifty = fifty;
+  state.hash_key = hash_key.get_board();
+  state.checkers = checkers;
+  state.pinned = pinned;
+
+  const Side moving_side = side;
+  const uint32_t from_sq = move.get_from_sq();
+  const uint32_t to_sq = move.get_to_sq();
+  const int piece_idx = get_piece_index(move.get_piece(), moving_side);
 
-  occupancies[static_cast<int>(moving_side)].pop_bit(from_sq);
-  occupancies[static_cast<int>(moving_side)].set_bit(to_sq);
-  occupancies[static_cast<int>(Side::any)].pop_bit(from_sq);
-  occupancies[static_cast<int>(Side::any)].set_bit(to_sq);
+  DirtyPieces& dirty = state.dirty;
+  dirty.count = 1;
+  dirty.piece[0] = piece_idx;
+  dirty.from[0] = from_sq;
+  dirty.to[0] = to_sq;
 
-  hash_key ^= zobrist_table.piece_keys[piece_idx][from_sq];
-  hash_key ^= zobrist_table.piece_keys[piece_idx][to_sq];
+  if (move.is_capture()) {
+    const int captured_sq = move.is_enpassant() ? to_sq + 8 - 16 * static_cast<int>(moving_side) : to_sq;
+    state.captured_piece = pop_piece(captured_sq);
+
+    dirty.piece[dirty.count] = state.captured_piece;
+    dirty.from[dirty.count] = captured_sq;
+    dirty.to[dirty.count] = DirtyPieces::NO_SQUARE;
+    dirty.count++;
+  }
+
+  move_piece(piece_idx, from_sq, to_sq);
 
   if (move.is_promo()) {
+    const int prom_idx = get_piece_index(move.get_prom_piece(), moving_side);
 
-    piece_location[piece_idx].pop_bit(to_sq);
+    remove_piece(piece_idx, to_sq);
+    put_piece(prom_idx, to_sq);
     hash_key ^= zobrist_table.piece_keys[piece_idx][to_sq];
-
-    const int prom_idx = static_cast<int>(move.get_prom_piece()) + NUMBER_OF_UNIQUE_PIECES * static_cast<int>(move.get_prom_side());
-    piece_location[prom_idx].set_bit(to_sq);
     hash_key ^= zobrist_table.piece_keys[prom_idx][to_sq];
 
+    dirty.to[0] = DirtyPieces::NO_SQUARE;
+    dirty.piece[dirty.count] = prom_idx;
+    dirty.from[dirty.count] = DirtyPieces::NO_SQUARE;
+    dirty.to[dirty.count] = to_sq;
+    dirty.count++;
   }
 
   if (move.is_castle()) {
-    const int rook_idx = static_cast<int>(PieceType::rook) + NUMBER_OF_UNIQUE_PIECES * static_cast<int>(moving_side);
-    int rook_to_sq, rook_from_sq;
-    
-    if (to_sq % 8 == 6) {  // King-side castle
-      rook_from_sq = to_sq + 1;
-      rook_to_sq = to_sq - 1;
-    } else {  // Queen-side castle
-      rook_from_sq = to_sq - 2;
-      rook_to_sq = to_sq + 1;
-    }
-    
-    piece_location[rook_idx].pop_bit(rook_from_sq);
-    piece_location[rook_idx].set_bit(rook_to_sq);
-    
-    // Update occupancies for rook movement
-    occupancies[static_cast<int>(moving_side)].pop_bit(rook_from_sq);
-    occupancies[static_cast<int>(moving_side)].set_bit(rook_to_sq);
-    occupancies[static_cast<int>(Side::any)].pop_bit(rook_from_sq);
-    occupancies[static_cast<int>(Side::any)].set_bit(rook_to_sq);
-    
-    // Update hash for rook movement
-    hash_key ^= zobrist_table.piece_keys[rook_idx][rook_from_sq];
-    hash_key ^= zobrist_table.piece_keys[rook_idx][rook_to_sq];
+    const int rook_idx = get_piece_index(PieceType::rook, moving_side);
+    move_piece(rook_idx, castling_rook_from(to_sq), castling_rook_to(to_sq));
+
+    dirty.piece[dirty.count] = rook_idx;
+    dirty.from[dirty.count] = castling_rook_from(to_sq);
+    dirty.to[dirty.count] = castling_rook_to(to_sq);
+    dirty.count++;
   }
 
   if (enpassant.first) {
@@ -398,26 +556,81 @@ bool Board::make_move(Move move) {
   castling &= castling_rights[to_sq];
   hash_key ^= zobrist_table.castle_keys[castling];
 
-  hash_key ^= zobrist_table.side_key;
   side = opposite_side(side);
   hash_key ^= zobrist_table.side_key;
 
-  if (resets_fifty_counter) {
+  if (move.get_piece() == PieceType::pawn || move.is_capture()) {
     fifty = 0;
   } else {
     fifty++;
   }
 
-  // Check if the move leaves our king in check (illegal move)
-  const Side our_side = opposite_side(side);
-  const int king_idx = get_piece_index(PieceType::king, our_side);
-  
-  const bb king_bb = piece_location[king_idx];
-  const int king_square = king_bb.get_lsb_index();
-  if (is_sq_attacked(king_square, side)) {
-    *this = board_cpy;
-    return false;
+  update_check_info();
+}
+
+// Takes back the last move played with make_move(move, state).
+void Board::unmake_move(Move move, const StateInfo& state) {
+  side = opposite_side(side);
+
+  const Side moving_side = side;
+  const uint32_t from_sq = move.get_from_sq();
+  const uint32_t to_sq = move.get_to_sq();
+  const int piece_idx = get_piece_index(move.get_piece(), moving_side);
+
+  if (move.is_promo()) {
+    remove_piece(get_piece_index(move.get_prom_piece(), moving_side), to_sq);
+    put_piece(piece_idx, to_sq);
   }
 
-  return true;
+  remove_piece(piece_idx, to_sq);
+  put_piece(piece_idx, from_sq);
+
+  if (move.is_castle()) {
+    const int rook_idx = get_piece_index(PieceType::rook, moving_side);
+    remove_piece(rook_idx, castling_rook_to(to_sq));
+    put_piece(rook_idx, castling_rook_from(to_sq));
+  }
+
+  if (state.captured_piece != NO_PIECE) {
+    const int captured_sq = move.is_enpassant() ? to_sq + 8 - 16 * static_cast<int>(moving_side) : to_sq;
+    put_piece(state.captured_piece, captured_sq);
+  }
+
+  castling = state.castling;
+  enpassant = state.enpassant;
+  fifty = state.fifty;
+  hash_key = bb(state.hash_key);
+  checkers = state.checkers;
+  pinned = state.pinned;
+}
+
+// Passes the turn. Only valid when the side to move is not in check.
+void Board::make_null_move(StateInfo& state) {
+  state.captured_piece = NO_PIECE;
+  state.castling = castling;
+  state.enpassant = enpassant;
+  state.fifty = fifty;
+  state.hash_key = hash_key.get_board();
+  state.checkers = checkers;
+  state.pinned = pinned;
+  state.dirty.count = 0;
+
+  if (enpassant.first) {
+    hash_key ^= zobrist_table.enp_keys[enpassant.second];
+    enpassant.first = false;
+  }
+
+  side = opposite_side(side);
+  hash_key ^= zobrist_table.side_key;
+
+  update_check_info();
+}
+
+void Board::unmake_null_move(const StateInfo& state) {
+  side = opposite_side(side);
+
+  enpassant = state.enpassant;
+  hash_key = bb(state.hash_key);
+  checkers = state.checkers;
+  pinned = state.pinned;
 }
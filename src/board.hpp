@@ -17,6 +17,34 @@ inline const std::string killer_position = "rnbqkb1r/pp1p1pPp/8/2p1pP2/1P1P4/3P3
 inline const std::string cmk_position = "r2q1rk1/ppp2ppp/2n1bn2/2b1p3/3pP3/3P1NPP/PPP1NPB1/R1BQ1RK1 b - - 0 9 ";
 inline const std::string repetitions = "2r3k1/R7/8/1R6/8/8/P4KPP/8 w - - 0 40 ";
 
+// Material values used by static exchange evaluation and capture ordering.
+inline constexpr std::array<int, NUMBER_OF_UNIQUE_PIECES> piece_values = {100, 300, 300, 500, 900, 20000};
+
+// Pieces that appeared, disappeared or moved with the last move, for the
+// incremental NNUE update. A piece index (piece + 6 * side) with squares,
+// NO_SQUARE standing for "off the board". The moving piece comes first.
+struct DirtyPieces {
+  static constexpr int NO_SQUARE = 64;
+
+  int count;
+  int piece[3];
+  int from[3];
+  int to[3];
+};
+
+// What make_move cannot recompute when the move is taken back. One record
+// per ply lives on the searching thread's stack.
+struct StateInfo {
+  int captured_piece;
+  uint32_t castling;
+  std::pair<bool, int> enpassant;
+  int fifty;
+  uint64_t hash_key;
+  uint64_t checkers;
+  uint64_t pinned;
+  DirtyPieces dirty;
+};
+
 class Board {
 private:
   static constexpr int BOARD_SIZE = 8;
@@ -34,26 +62,52 @@ private:
 
   std::array<bb, NUMBER_OF_PIECES> piece_location{};
   std::array<bb, NUMBER_OF_SIDES> occupancies{};
+  std::array<uint8_t, TOTAL_SQUARES> mailbox{};
   Side side = Side::white;
   std::pair<bool, int> enpassant;
   uint32_t castling = 0;
   bb hash_key{};
   uint32_t rep_idx = 0;
   int fifty = 0;
+  uint64_t checkers = 0;
+  uint64_t pinned = 0;
 
   void reset();
+  void update_check_info();
   uint64_t generate_hash_key();
-  void move_piece(int piexe_idx, int from_sq, int to_sq);
-  void pop_piece(int sq, Side side);
+  void put_piece(int piece_idx, int sq);
+  void remove_piece(int piece_idx, int sq);
+  void move_piece(int piece_idx, int from_sq, int to_sq);
+  int pop_piece(int sq);
   
 public:
+  static constexpr int NO_PIECE = NUMBER_OF_PIECES;
+
   void load_fen(const std::string& fen);
   void print() const;
   bool is_sq_attacked(int sq, Side attacking_side) const;
+  bool in_check() const { return checkers != 0; }
   void print_insides();
-  bool make_move(Move move);
+  void make_move(Move move, StateInfo& state);
+  void unmake_move(Move move, const StateInfo& state);
+  void make_null_move(StateInfo& state);
+  void unmake_null_move(const StateInfo& state);
+
+  // For moves that are never taken back, such as the ones from "position".
+  void make_move(Move move) {
+    StateInfo state;
+    make_move(move, state);
+  }
+
+  uint64_t attackers_to(int sq, uint64_t occupancy) const;
+  bool see_ge(Move move, int threshold) const;
   Side get_side() const { return side; }
   
+  // Piece index (piece + 6 * side) standing on sq, or NO_PIECE.
+  int piece_on(int sq) const {
+    return mailbox[sq];
+  }
+
   const std::array<bb, NUMBER_OF_PIECES>& get_piece_locations() const { 
     return piece_location; 
   }
@@ -91,6 +145,16 @@ public:
     return castling & right;
   }
 
+  // Enemy pieces giving check to the side to move.
+  uint64_t get_checkers() const {
+    return checkers;
+  }
+
+  // Pieces of the side to move that shield their own king from a slider.
+  uint64_t get_pinned() const {
+    return pinned;
+  }
+
   int get_fifty_move_counter() const { 
     return fifty; 
   }
@@ -99,21 +163,14 @@ public:
     return fifty >= 100;  // 100 half-moves = 50 full moves
   }
 
-  uint64_t get_hash_key() {
+  uint64_t get_hash_key() const {
     return hash_key.get_board();
   }
+
+  // The hash key make_move(move) would leave, without playing the move.
+  uint64_t key_after(Move move) const;
   
   void set_fifty_move_counter(int value) {
     fifty = value;
   }
-
-  void change_hash_en() {
-    hash_key ^= zobrist_table.enp_keys[enpassant.second];
-    enpassant.first = false;
-  }
-
-  void switch_side() {
-    side = opposite_side(side);
-    hash_key ^= zobrist_table.side_key;
-  }
 };
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "evaluation.hpp"
+#include <vector>
 #include "enums.hpp"
 #include "./nnue/nnue.h"
 
@@ -10,43 +11,73 @@ static inline int sq_to_nnue_sq(int sq) {
   return (7 - (sq / 8)) * 8 + (sq % 8);
 }
 
-int evaluate(const Board& board) {
-  int pieces[33];
-  int squares[33];
-  int index = 2;
-  
-  bb white_king_bb = board.get_piece_bitboard_by_idx(5);
-  pieces[0] = piece_idx_to_nnue_idx(5);
-  squares[0] = sq_to_nnue_sq(white_king_bb.get_lsb_index());
-  
-  bb black_king_bb = board.get_piece_bitboard_by_idx(11);
-  pieces[1] = piece_idx_to_nnue_idx(5);
-  squares[1] = sq_to_nnue_sq(black_king_bb.get_lsb_index());
-  
+// Piece bitboards indexed by NNUE piece code. The NNUE numbers squares from
+// a1 while the board starts at a8, which mirrors the ranks: a byte swap.
+static void fill_bitboards(const Board& board, uint64_t* bitboards) {
+  const auto& locations = board.get_piece_locations();
+  bitboards[0] = 0;
   for (int piece_idx = 0; piece_idx < NUMBER_OF_UNIQUE_PIECES * NUMBER_OF_SIDES; ++piece_idx) {
-    if (piece_idx == 5 || piece_idx == 11) {
-      continue;
-    }
-    
-    bb piece_bb = board.get_piece_bitboard_by_idx(piece_idx);
-    
-    if (!piece_bb.get_board()) {
-      continue;
-    }
-    
-    const int nnue_piece = piece_idx_to_nnue_idx(piece_idx);
-
-    while (piece_bb.get_board()) {
-      const int sq = piece_bb.get_lsb_index();
-      pieces[index] = nnue_piece;
-      squares[index] = sq_to_nnue_sq(sq);
-      index++;
-      piece_bb.pop_bit(sq);
-    }
+    bitboards[piece_idx_to_nnue_idx(piece_idx)] = __builtin_bswap64(locations[piece_idx].get_board());
+  }
+}
+
+int evaluate(const Board& board) {
+  uint64_t bitboards[13];
+  fill_bitboards(board, bitboards);
+
+  NNUEdata data;
+  data.accumulator.computedAccumulation[0] = false;
+  data.accumulator.computedAccumulation[1] = false;
+  data.dirtyPiece.dirtyNum = 0;
+  return nnue_evaluate_bitboards(static_cast<int>(board.get_side()), bitboards, &data, 0, nullptr) *
+         (100 - board.get_fifty_move_counter()) / 100;
+}
+
+void evaluate_batch(const Board* boards, int count, int* scores, int threads) {
+  std::vector<int> players(count);
+  std::vector<uint64_t> bitboards(13 * static_cast<size_t>(count));
+  for (int i = 0; i < count; ++i) {
+    players[i] = static_cast<int>(boards[i].get_side());
+    fill_bitboards(boards[i], &bitboards[13 * static_cast<size_t>(i)]);
+  }
+
+  nnue_evaluate_batch_bitboards(count, players.data(), bitboards.data(), scores, threads);
+
+  for (int i = 0; i < count; ++i) {
+    scores[i] = scores[i] * (100 - boards[i].get_fifty_move_counter()) / 100;
+  }
+}
+
+void AccumulatorStack::reset() {
+  ply = 0;
+  stack[0].accumulator.computedAccumulation[0] = false;
+  stack[0].accumulator.computedAccumulation[1] = false;
+  stack[0].dirtyPiece.dirtyNum = 0;
+  nnue_clear_finny_table(&finny);
+}
+
+void AccumulatorStack::push(const DirtyPieces& dirty) {
+  NNUEdata& data = stack[++ply];
+  data.accumulator.computedAccumulation[0] = false;
+  data.accumulator.computedAccumulation[1] = false;
+
+  DirtyPiece& dp = data.dirtyPiece;
+  dp.dirtyNum = dirty.count;
+  for (int i = 0; i < dirty.count; ++i) {
+    dp.pc[i] = piece_idx_to_nnue_idx(dirty.piece[i]);
+    dp.from[i] = dirty.from[i] == DirtyPieces::NO_SQUARE ? 64 : sq_to_nnue_sq(dirty.from[i]);
+    dp.to[i] = dirty.to[i] == DirtyPieces::NO_SQUARE ? 64 : sq_to_nnue_sq(dirty.to[i]);
   }
+}
+
+void AccumulatorStack::pop() {
+  --ply;
+}
 
-  pieces[index] = 0;
-  squares[index] = 0;
+int AccumulatorStack::evaluate(const Board& board) {
+  uint64_t bitboards[13];
+  fill_bitboards(board, bitboards);
 
-  return nnue_evaluate(static_cast<int>(board.get_side()), pieces, squares) * (100 - board.get_fifty_move_counter()) / 100;
+  return nnue_evaluate_bitboards(static_cast<int>(board.get_side()), bitboards, stack.data(), ply, &finny) *
+         (100 - board.get_fifty_move_counter()) / 100;
 }
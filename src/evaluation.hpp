@@ -1,5 +1,34 @@
 #pragma once
 
+#include <array>
 #include "board.hpp"
+#include "./nnue/nnue.h"
 
 int evaluate(const Board& board);
+
+// evaluate() for each of count boards, run through the network together and
+// spread over up to threads threads. Meant for scoring large position sets.
+void evaluate_batch(const Board* boards, int count, int* scores, int threads = 1);
+
+// NNUE accumulators for the positions along the current search path, pushed
+// and popped together with make_move/unmake_move. Only the dirty pieces are
+// recorded on a push; the accumulators themselves are brought up to date
+// when a position is actually evaluated. Refreshes after king moves start
+// from the thread's cached accumulator for the new king square.
+class AccumulatorStack {
+public:
+  static constexpr int MAX_DEPTH = 128;
+
+  // Starts a new search from the root position.
+  void reset();
+  void push(const DirtyPieces& dirty);
+  void pop();
+
+  // Same result as evaluate(board) for the position on top of the stack.
+  int evaluate(const Board& board);
+
+private:
+  std::array<NNUEdata, MAX_DEPTH + 1> stack;
+  int ply = 0;
+  FinnyTable finny;
+};
@@ -12,18 +12,17 @@ public:
   // Constructors
   constexpr Move() noexcept : body(0) {}
   
+  // The moving side is always the side to move, so it is not stored.
+  // prom_pce is PieceType::pawn for anything but a promotion.
   constexpr Move(uint32_t from_sq, uint32_t to_sq,
-                 PieceType piece, Side side_of_piece,
-                 PieceType prom_pce, Side side_of_prom,
+                 PieceType piece, PieceType prom_pce,
                  MoveFlag flag, bool is_capture = false) noexcept
     : body((from_sq & 0x3F)
          | ((to_sq & 0x3F) << 6)
          | ((static_cast<uint32_t>(piece) & 0x7) << 12)
-         | ((static_cast<uint32_t>(side_of_piece) & 0x3) << 15)
-         | ((static_cast<uint32_t>(prom_pce) & 0x7) << 17)
-         | ((static_cast<uint32_t>(side_of_prom) & 0x3) << 20)
-         | ((static_cast<uint32_t>(flag) & 0x7) << 22)
-         | ((is_capture ? 1U : 0U) << 25)) {}
+         | ((static_cast<uint32_t>(prom_pce) & 0x7) << 15)
+         | ((static_cast<uint32_t>(flag) & 0x7) << 18)
+         | ((is_capture ? 1U : 0U) << 21)) {}
 
   // Getters
   constexpr uint32_t get_from_sq() const noexcept {
@@ -38,37 +37,29 @@ public:
     return static_cast<PieceType>((body >> 12) & 0x7);
   }
 
-  constexpr Side get_side_of_piece() const noexcept {
-    return static_cast<Side>((body >> 15) & 0x3);
-  }
-
   constexpr bool is_promo() const noexcept {
-    return static_cast<Side>((body >> 20) & 0x3) != Side::any;
+    return get_prom_piece() != PieceType::pawn;
   }
 
   constexpr PieceType get_prom_piece() const noexcept {
-    return static_cast<PieceType>((body >> 17) & 0x7);
-  }
-
-  constexpr Side get_prom_side() const noexcept {
-    return static_cast<Side>((body >> 20) & 0x3);
+    return static_cast<PieceType>((body >> 15) & 0x7);
   }
 
   // Flag checks
   constexpr bool is_double_pawn() const noexcept {
-    return ((body >> 22) & 0x7) == MoveFlag::PAWN_START;
+    return ((body >> 18) & 0x7) == MoveFlag::PAWN_START;
   }
 
   constexpr bool is_castle() const noexcept {
-    return ((body >> 22) & 0x7) == MoveFlag::CASTLE;
+    return ((body >> 18) & 0x7) == MoveFlag::CASTLE;
   }
 
   constexpr bool is_enpassant() const noexcept {
-    return ((body >> 22) & 0x7) == MoveFlag::EN_PASSANT;
+    return ((body >> 18) & 0x7) == MoveFlag::EN_PASSANT;
   }
 
   constexpr bool is_capture() const noexcept {
-    return (body >> 25) & 0x1;
+    return (body >> 21) & 0x1;
   }
 
   // Utility functions
@@ -76,6 +67,12 @@ public:
     return body;
   }
 
+  // from, to and promotion piece in 15 bits, enough for the transposition
+  // table; move_from_compact() rebuilds the rest from the position.
+  constexpr uint16_t to_compact() const noexcept {
+    return static_cast<uint16_t>((body & 0xFFF) | (((body >> 15) & 0x7) << 12));
+  }
+
   constexpr bool operator==(const Move& other) const noexcept {
     return body == other.body;
   }
@@ -95,14 +92,8 @@ public:
       return std::string(1, files[file]) + std::to_string(rank);
     };
     
-    auto piece_to_string = [](PieceType piece, Side side) -> std::string {
-      std::string side_str;
-      switch (side) {
-        case Side::white: side_str = "white "; break;
-        case Side::black: side_str = "black "; break;
-        default: side_str = ""; break;
-      }
-      return side_str + piece_names[static_cast<int>(piece)];
+    auto piece_to_string = [](PieceType piece) -> std::string {
+      return piece_names[static_cast<int>(piece)];
     };
     
     auto flag_to_string = [](MoveFlag flag) -> const char* {
@@ -115,16 +106,16 @@ public:
       }
     };
 
-    MoveFlag flag = static_cast<MoveFlag>((body >> 22) & 0x7);
+    MoveFlag flag = static_cast<MoveFlag>((body >> 18) & 0x7);
 
     std::cout << "Move("
               << square_to_string(get_from_sq())
               << " -> "
               << square_to_string(get_to_sq())
-              << ", piece=" << piece_to_string(get_piece(), get_side_of_piece());
+              << ", piece=" << piece_to_string(get_piece());
 
     if (is_promo()) {
-      std::cout << ", promo=" << piece_to_string(get_prom_piece(), get_prom_side());
+      std::cout << ", promo=" << piece_to_string(get_prom_piece());
     }
 
     if (is_capture()) {
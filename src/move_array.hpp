@@ -3,25 +3,56 @@
 #include <iostream>
 #include "move.hpp"
 
+struct ScoredMove {
+  Move move;
+  int score;
+};
+
 class MoveArray {
 private:
   static constexpr int MAX_MOVES = 218;
   size_t arr_size = 0;
-  std::array<Move, MAX_MOVES> moves{};
+  std::array<ScoredMove, MAX_MOVES> moves{};
 public:
   inline size_t size() const {
     return arr_size;
   }
 
   inline void push(const Move move) {
-    moves[arr_size++] = move;
+    moves[arr_size++] = {move, 0};
   }
 
   inline Move get(const int i) const {
-    return moves[i];
+    return moves[i].move;
+  }
+
+  inline int get_score(const int i) const {
+    return moves[i].score;
+  }
+
+  inline void set_score(const int i, const int score) {
+    moves[i].score = score;
+  }
+
+  // Drops entry i by moving the last one into its place.
+  inline void remove(const int i) {
+    moves[i] = moves[--arr_size];
   }
 
   inline void swap(const int i1, const int i2) {
     std::swap(moves[i1], moves[i2]);
   }
-};
\ No newline at end of file
+
+  // One step of a selection sort: moves the best scored entry of
+  // [begin, end) to begin and returns it.
+  inline Move select_best(const size_t begin, const size_t end) {
+    size_t best = begin;
+    for (size_t i = begin + 1; i < end; ++i) {
+      if (moves[i].score > moves[best].score) {
+        best = i;
+      }
+    }
+    std::swap(moves[begin], moves[best]);
+    return moves[begin].move;
+  }
+};
@@ -1,59 +1,74 @@
 #include "move_generator.hpp"
+#include <cstdlib>
 
-static inline void add_move(MoveArray& moves, uint32_t from, uint32_t to, 
-                           PieceType piece, Side piece_side, 
-                           PieceType promo_piece = PieceType::pawn, Side promo_side = Side::any,
+static inline void add_move(MoveArray& moves, uint32_t from, uint32_t to, PieceType piece,
+                           PieceType promo_piece = PieceType::pawn,
                            MoveFlag flag = MoveFlag::NO_FLAG, bool is_capture = false) {
-  moves.push(Move(from, to, piece, piece_side, promo_piece, promo_side, flag, is_capture));
+  moves.push(Move(from, to, piece, promo_piece, flag, is_capture));
 }
 
-static inline void add_promotion_moves(MoveArray& moves, int from, int to, Side side, 
-                                      bool is_capture = false) {
-  add_move(moves, from, to, PieceType::pawn, side, PieceType::queen, side, MoveFlag::NO_FLAG, is_capture);
-  add_move(moves, from, to, PieceType::pawn, side, PieceType::rook, side, MoveFlag::NO_FLAG, is_capture);
-  add_move(moves, from, to, PieceType::pawn, side, PieceType::bishop, side, MoveFlag::NO_FLAG, is_capture);
-  add_move(moves, from, to, PieceType::pawn, side, PieceType::knight, side, MoveFlag::NO_FLAG, is_capture);
+static inline void add_promotion_moves(MoveArray& moves, int from, int to, bool is_capture = false) {
+  add_move(moves, from, to, PieceType::pawn, PieceType::queen, MoveFlag::NO_FLAG, is_capture);
+  add_move(moves, from, to, PieceType::pawn, PieceType::rook, MoveFlag::NO_FLAG, is_capture);
+  add_move(moves, from, to, PieceType::pawn, PieceType::bishop, MoveFlag::NO_FLAG, is_capture);
+  add_move(moves, from, to, PieceType::pawn, PieceType::knight, MoveFlag::NO_FLAG, is_capture);
 }
 
-static inline void handle_pawn_push(MoveArray& moves, int from_sq, int to_sq, Side side, int rank, int promo_rank) {
+// Pawn moves restricted to target masks: non-promoting pushes must land on
+// quiet_target, promoting pushes on promo_target and captures on
+// capture_target. En passant is only added when include_enpassant is set.
+struct PawnTargets {
+  uint64_t quiet_target;
+  uint64_t promo_target;
+  uint64_t capture_target;
+  bool include_enpassant;
+};
+
+static inline void handle_pawn_push(MoveArray& moves, int from_sq, int to_sq, int rank, int promo_rank,
+                                   const PawnTargets& targets) {
   if (rank == promo_rank) {
-    add_promotion_moves(moves, from_sq, to_sq, side);
+    if (targets.promo_target & square_bb(to_sq)) {
+      add_promotion_moves(moves, from_sq, to_sq);
+    }
     return;
   }
   
-  add_move(moves, from_sq, to_sq, PieceType::pawn, side);
+  if (targets.quiet_target & square_bb(to_sq)) {
+    add_move(moves, from_sq, to_sq, PieceType::pawn);
+  }
 }
 
 static inline void handle_double_pawn_push(MoveArray& moves, const Board& board, int from_sq, int direction, 
-                                          Side side, int rank, int start_rank) {
+                                          int rank, int start_rank, const PawnTargets& targets) {
   if (rank != start_rank) {
     return;
   }
   
   int double_push_sq = from_sq + 2 * direction;
   bb all_pieces = board.get_all_occupancy();
-  if (all_pieces.get_bit(double_push_sq)) {
+  if (all_pieces.get_bit(double_push_sq) || !(targets.quiet_target & square_bb(double_push_sq))) {
     return;
   }
   
-  add_move(moves, from_sq, double_push_sq, PieceType::pawn, side, 
-          PieceType::pawn, Side::any, MoveFlag::PAWN_START);
+  add_move(moves, from_sq, double_push_sq, PieceType::pawn, 
+          PieceType::pawn, MoveFlag::PAWN_START);
 }
 
-static inline void handle_pawn_captures(MoveArray& moves, int from_sq, Side side, int rank, int promo_rank, bb enemy_pieces) {
+static inline void handle_pawn_captures(MoveArray& moves, int from_sq, Side side, int rank, int promo_rank,
+                                       const PawnTargets& targets) {
   bb pawn_attacks = pawn_masks[static_cast<int>(side)][from_sq];
-  bb capture_targets = bb(pawn_attacks.get_board() & enemy_pieces.get_board());
+  bb capture_targets = bb(pawn_attacks.get_board() & targets.capture_target);
   
   while (capture_targets.get_board() != 0) {
     int capture_sq = capture_targets.get_lsb_index();
     capture_targets.pop_bit(capture_sq);
     
     if (rank == promo_rank) {
-      add_promotion_moves(moves, from_sq, capture_sq, side, true);
+      add_promotion_moves(moves, from_sq, capture_sq, true);
       continue;
     }
-    add_move(moves, from_sq, capture_sq, PieceType::pawn, side, 
-            PieceType::pawn, Side::any, MoveFlag::NO_FLAG, true);
+    add_move(moves, from_sq, capture_sq, PieceType::pawn, 
+            PieceType::pawn, MoveFlag::NO_FLAG, true);
   }
 }
 
@@ -69,14 +84,13 @@ static inline void handle_en_passant(MoveArray& moves, const Board& board, int f
     return;
   }
   
-  add_move(moves, from_sq, enpassant.second, PieceType::pawn, side, 
-          PieceType::pawn, Side::any, MoveFlag::EN_PASSANT, true);
+  add_move(moves, from_sq, enpassant.second, PieceType::pawn, 
+          PieceType::pawn, MoveFlag::EN_PASSANT, true);
 }
 
-static inline void generate_pawn_moves(MoveArray& moves, const Board& board, Side side) {
+static inline void generate_pawn_moves(MoveArray& moves, const Board& board, Side side, const PawnTargets& targets) {
   bb pawns = board.get_piece_bitboard(PieceType::pawn, side);
   bb all_pieces = board.get_all_occupancy();
-  bb enemy_pieces = board.get_occupancy(opposite_side(side));
   
   int side_val = static_cast<int>(side);
   int direction = -8 + 16 * side_val;  // white=-8, black=8
@@ -91,48 +105,52 @@ static inline void generate_pawn_moves(MoveArray& moves, const Board& board, Sid
     int to_sq = from_sq + direction;
     
     if (!all_pieces.get_bit(to_sq)) {
-      handle_pawn_push(moves, from_sq, to_sq, side, rank, promo_rank);
-      handle_double_pawn_push(moves, board, from_sq, direction, side, rank, start_rank);
+      handle_pawn_push(moves, from_sq, to_sq, rank, promo_rank, targets);
+      handle_double_pawn_push(moves, board, from_sq, direction, rank, start_rank, targets);
     }
     
-    handle_pawn_captures(moves, from_sq, side, rank, promo_rank, enemy_pieces);
+    handle_pawn_captures(moves, from_sq, side, rank, promo_rank, targets);
     
-    handle_en_passant(moves, board, from_sq, side);
+    if (targets.include_enpassant) {
+      handle_en_passant(moves, board, from_sq, side);
+    }
   }
 }
 
 template<PieceType piece_type>
-static inline void generate_piece_moves(MoveArray& moves, const Board& board, Side side) {
+static inline bb piece_attacks(int from_sq, bb occupancy) {
+  if constexpr (piece_type == PieceType::knight) {
+    return knight_masks[from_sq];
+  } else if constexpr (piece_type == PieceType::king) {
+    return king_masks[from_sq];
+  } else if constexpr (piece_type == PieceType::bishop) {
+    return get_bishop_attacks(from_sq, occupancy);
+  } else if constexpr (piece_type == PieceType::rook) {
+    return get_rook_attacks(from_sq, occupancy);
+  } else {
+    return get_queen_attacks(from_sq, occupancy);
+  }
+}
+
+template<PieceType piece_type>
+static inline void generate_piece_moves(MoveArray& moves, const Board& board, Side side, uint64_t target) {
   bb pieces = board.get_piece_bitboard(piece_type, side);
-  bb own_pieces = board.get_occupancy(side);
   bb enemy_pieces = board.get_occupancy(opposite_side(side));
   
   while (pieces.get_board() != 0) {
     int from_sq = pieces.get_lsb_index();
     pieces.pop_bit(from_sq);
     
-    bb attacks;
-    if constexpr (piece_type == PieceType::knight) {
-      attacks = knight_masks[from_sq];
-    } else if constexpr (piece_type == PieceType::king) {
-      attacks = king_masks[from_sq];
-    } else if constexpr (piece_type == PieceType::bishop) {
-      attacks = get_bishop_attacks(from_sq, board.get_all_occupancy());
-    } else if constexpr (piece_type == PieceType::rook) {
-      attacks = get_rook_attacks(from_sq, board.get_all_occupancy());
-    } else if constexpr (piece_type == PieceType::queen) {
-      attacks = get_queen_attacks(from_sq, board.get_all_occupancy());
-    }
-    
-    attacks &= bb(~own_pieces.get_board());
+    bb attacks = piece_attacks<piece_type>(from_sq, board.get_all_occupancy());
+    attacks &= bb(target);
     
     while (attacks.get_board() != 0) {
       int to_sq = attacks.get_lsb_index();
       attacks.pop_bit(to_sq);
       
       bool is_capture = enemy_pieces.get_bit(to_sq);
-      add_move(moves, from_sq, to_sq, piece_type, side, 
-              PieceType::pawn, Side::any, MoveFlag::NO_FLAG, is_capture);
+      add_move(moves, from_sq, to_sq, piece_type, 
+              PieceType::pawn, MoveFlag::NO_FLAG, is_capture);
     }
   }
 }
@@ -176,26 +194,236 @@ static inline void generate_castling_moves(MoveArray& moves, const Board& board,
   // Kingside castling
   if (can_castle_side(board, side, true, all_pieces, enemy_side)) {
     int to_sq = from_sq + 2;
-    add_move(moves, from_sq, to_sq, PieceType::king, side, 
-            PieceType::pawn, Side::any, MoveFlag::CASTLE);
+    add_move(moves, from_sq, to_sq, PieceType::king, 
+            PieceType::pawn, MoveFlag::CASTLE);
   }
   
   // Queenside castling
   if (can_castle_side(board, side, false, all_pieces, enemy_side)) {
     int to_sq = from_sq - 2;
-    add_move(moves, from_sq, to_sq, PieceType::king, side, 
-            PieceType::pawn, Side::any, MoveFlag::CASTLE);
+    add_move(moves, from_sq, to_sq, PieceType::king, 
+            PieceType::pawn, MoveFlag::CASTLE);
+  }
+}
+
+template<GenType gen_type>
+static void generate_pseudo_legal(MoveArray& moves, const Board& board) {
+  const Side side_to_move = board.get_side();
+  const Side enemy_side = opposite_side(side_to_move);
+  const uint64_t enemy = board.get_occupancy(enemy_side).get_board();
+  const uint64_t empty = ~board.get_all_occupancy().get_board();
+
+  if constexpr (gen_type == GenType::evasions) {
+    const uint64_t own = board.get_occupancy(side_to_move).get_board();
+    const int king_sq = board.get_piece_bitboard(PieceType::king, side_to_move).get_lsb_index();
+
+    // King steps first; with two checkers nothing else can help.
+    generate_piece_moves<PieceType::king>(moves, board, side_to_move, ~own);
+
+    const uint64_t checkers = board.get_checkers();
+    if (checkers == 0 || (checkers & (checkers - 1))) {
+      return;
+    }
+
+    const int checker_sq = __builtin_ctzll(checkers);
+    const uint64_t block = between_masks[king_sq][checker_sq];
+    const auto enpassant = board.get_enpassant();
+    const int enpassant_victim_sq = enpassant.second + 8 - 16 * static_cast<int>(side_to_move);
+    const bool enpassant_evades = enpassant.first &&
+      (enpassant_victim_sq == checker_sq || (block & square_bb(enpassant.second)));
+
+    generate_pawn_moves(moves, board, side_to_move, {block, block, checkers, enpassant_evades});
+    generate_piece_moves<PieceType::knight>(moves, board, side_to_move, block | checkers);
+    generate_piece_moves<PieceType::bishop>(moves, board, side_to_move, block | checkers);
+    generate_piece_moves<PieceType::rook>(moves, board, side_to_move, block | checkers);
+    generate_piece_moves<PieceType::queen>(moves, board, side_to_move, block | checkers);
+  } else {
+    // captures: every capture plus all promotions; quiets: everything else.
+    constexpr bool with_captures = gen_type != GenType::quiets;
+    constexpr bool with_quiets = gen_type != GenType::captures;
+    const uint64_t target = (with_captures ? enemy : 0) | (with_quiets ? empty : 0);
+
+    generate_pawn_moves(moves, board, side_to_move,
+                        {with_quiets ? empty : 0, with_captures ? empty : 0, with_captures ? enemy : 0, with_captures});
+    generate_piece_moves<PieceType::knight>(moves, board, side_to_move, target);
+    generate_piece_moves<PieceType::bishop>(moves, board, side_to_move, target);
+    generate_piece_moves<PieceType::rook>(moves, board, side_to_move, target);
+    generate_piece_moves<PieceType::queen>(moves, board, side_to_move, target);
+    generate_piece_moves<PieceType::king>(moves, board, side_to_move, target);
+
+    if constexpr (with_quiets) {
+      generate_castling_moves(moves, board, side_to_move);
+    }
   }
 }
 
+// Only king moves, en passant, moves of pinned pieces and moves made while in
+// check can be illegal; everything else skips the full test.
+template<GenType gen_type>
+void fill_move_array(MoveArray& moves, const Board& board) {
+  const size_t first = moves.size();
+  generate_pseudo_legal<gen_type>(moves, board);
+
+  const uint64_t pinned = board.get_pinned();
+  const int king_sq = board.get_piece_bitboard(PieceType::king, board.get_side()).get_lsb_index();
+  const bool in_check = board.in_check();
+
+  for (size_t i = first; i < moves.size();) {
+    const Move move = moves.get(i);
+    const bool needs_test = in_check || move.is_enpassant() ||
+                            static_cast<int>(move.get_from_sq()) == king_sq ||
+                            (pinned & square_bb(move.get_from_sq()));
+
+    if (needs_test && !is_legal(board, move)) {
+      moves.remove(i);
+    } else {
+      ++i;
+    }
+  }
+}
+
+template void fill_move_array<GenType::captures>(MoveArray& moves, const Board& board);
+template void fill_move_array<GenType::quiets>(MoveArray& moves, const Board& board);
+template void fill_move_array<GenType::evasions>(MoveArray& moves, const Board& board);
+template void fill_move_array<GenType::all>(MoveArray& moves, const Board& board);
+
 void fill_move_array(MoveArray& moves, const Board& board) {
-  Side side_to_move = board.get_side();
-  
-  generate_pawn_moves(moves, board, side_to_move);
-  generate_piece_moves<PieceType::knight>(moves, board, side_to_move);
-  generate_piece_moves<PieceType::bishop>(moves, board, side_to_move);
-  generate_piece_moves<PieceType::rook>(moves, board, side_to_move);
-  generate_piece_moves<PieceType::queen>(moves, board, side_to_move);
-  generate_piece_moves<PieceType::king>(moves, board, side_to_move);
-  generate_castling_moves(moves, board, side_to_move);
-}
\ No newline at end of file
+  fill_move_array<GenType::all>(moves, board);
+}
+
+bool is_pseudo_legal(const Board& board, Move move) {
+  const Side side = board.get_side();
+  const int side_val = static_cast<int>(side);
+
+  if (move.get_body() == 0) {
+    return false;
+  }
+
+  const int from_sq = move.get_from_sq();
+  const int to_sq = move.get_to_sq();
+  const PieceType piece = move.get_piece();
+
+  if (!board.get_piece_bitboard(piece, side).get_bit(from_sq) ||
+      board.get_occupancy(side).get_bit(to_sq)) {
+    return false;
+  }
+
+  if (move.is_castle()) {
+    const int king_sq = 60 - 56 * side_val;
+    if (piece != PieceType::king || from_sq != king_sq || (to_sq != king_sq + 2 && to_sq != king_sq - 2)) {
+      return false;
+    }
+    return can_castle_side(board, side, to_sq == king_sq + 2, board.get_all_occupancy(), opposite_side(side));
+  }
+
+  const bb enemy_pieces = board.get_occupancy(opposite_side(side));
+
+  if (move.is_enpassant()) {
+    const auto enpassant = board.get_enpassant();
+    return piece == PieceType::pawn && move.is_capture() && enpassant.first && enpassant.second == to_sq &&
+           pawn_masks[side_val][from_sq].get_bit(to_sq);
+  }
+
+  if (move.is_capture() != enemy_pieces.get_bit(to_sq)) {
+    return false;
+  }
+
+  if (piece != PieceType::pawn) {
+    if (move.is_promo() || move.is_double_pawn()) {
+      return false;
+    }
+
+    bb attacks;
+    switch (piece) {
+      case PieceType::knight: attacks = knight_masks[from_sq]; break;
+      case PieceType::bishop: attacks = get_bishop_attacks(from_sq, board.get_all_occupancy()); break;
+      case PieceType::rook:   attacks = get_rook_attacks(from_sq, board.get_all_occupancy()); break;
+      case PieceType::queen:  attacks = get_queen_attacks(from_sq, board.get_all_occupancy()); break;
+      default:                attacks = king_masks[from_sq]; break;
+    }
+    return attacks.get_bit(to_sq);
+  }
+
+  const int direction = -8 + 16 * side_val;
+  const int start_rank = 6 - 5 * side_val;
+  const int promo_rank = 1 + 5 * side_val;
+  const int rank = from_sq / 8;
+
+  if (move.is_promo() != (rank == promo_rank)) {
+    return false;
+  }
+
+  if (move.is_capture()) {
+    return !move.is_double_pawn() && pawn_masks[side_val][from_sq].get_bit(to_sq);
+  }
+
+  if (move.is_double_pawn()) {
+    return rank == start_rank && to_sq == from_sq + 2 * direction &&
+           !board.get_all_occupancy().get_bit(from_sq + direction) &&
+           !board.get_all_occupancy().get_bit(to_sq);
+  }
+
+  return to_sq == from_sq + direction;
+}
+
+
+bool is_legal(const Board& board, Move move) {
+  const Side side = board.get_side();
+  const Side enemy_side = opposite_side(side);
+  const int from_sq = move.get_from_sq();
+  const int to_sq = move.get_to_sq();
+  const int king_sq = board.get_piece_bitboard(PieceType::king, side).get_lsb_index();
+  const uint64_t occupied = board.get_all_occupancy().get_board();
+  const uint64_t enemy = board.get_occupancy(enemy_side).get_board();
+
+  if (move.is_enpassant()) {
+    // Replay the capture on the occupancy and look at the king directly.
+    const int victim_sq = to_sq + 8 - 16 * static_cast<int>(side);
+    const uint64_t after = (occupied ^ square_bb(from_sq) ^ square_bb(victim_sq)) | square_bb(to_sq);
+    return !(board.attackers_to(king_sq, after) & enemy & ~square_bb(victim_sq));
+  }
+
+  if (from_sq == king_sq) {
+    // Lift the king so that sliders checking it also cover the squares behind.
+    return !(board.attackers_to(to_sq, occupied ^ square_bb(from_sq)) & enemy);
+  }
+
+  const uint64_t checkers = board.get_checkers();
+  if (checkers) {
+    if (checkers & (checkers - 1)) {
+      return false;
+    }
+    const uint64_t evasion_targets = checkers | between_masks[king_sq][__builtin_ctzll(checkers)];
+    if (!(evasion_targets & square_bb(to_sq))) {
+      return false;
+    }
+  }
+
+  return !(board.get_pinned() & square_bb(from_sq)) || (line_masks[king_sq][from_sq] & square_bb(to_sq));
+}
+
+Move move_from_compact(const Board& board, uint16_t compact) {
+  const int from_sq = compact & 0x3F;
+  const int to_sq = (compact >> 6) & 0x3F;
+  const int piece_index = board.piece_on(from_sq);
+
+  if (!compact || piece_index == Board::NO_PIECE) {
+    return Move{};
+  }
+
+  const PieceType piece = static_cast<PieceType>(piece_index % NUMBER_OF_UNIQUE_PIECES);
+  const PieceType prom_piece = static_cast<PieceType>((compact >> 12) & 0x7);
+  const bool takes_piece = board.piece_on(to_sq) != Board::NO_PIECE;
+  const int distance = std::abs(to_sq - from_sq);
+
+  if (piece == PieceType::pawn && distance == 16) {
+    return Move(from_sq, to_sq, piece, prom_piece, MoveFlag::PAWN_START);
+  }
+  if (piece == PieceType::king && distance == 2) {
+    return Move(from_sq, to_sq, piece, prom_piece, MoveFlag::CASTLE);
+  }
+  if (piece == PieceType::pawn && !takes_piece && ((from_sq ^ to_sq) & 0x7)) {
+    return Move(from_sq, to_sq, piece, prom_piece, MoveFlag::EN_PASSANT, true);
+  }
+  return Move(from_sq, to_sq, piece, prom_piece, MoveFlag::NO_FLAG, takes_piece);
+}
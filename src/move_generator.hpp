@@ -4,4 +4,30 @@
 #include "board.hpp"
 #include "move_array.hpp"
 
-void fill_move_array(MoveArray& moves, const Board& board);
\ No newline at end of file
+// What a call to fill_move_array produces; every generated move is legal. captures holds every capture
+// plus all promotions and quiets holds the rest, so together they equal all.
+// evasions is only meaningful when the side to move is in check.
+enum class GenType {
+  captures,
+  quiets,
+  evasions,
+  all
+};
+
+template<GenType gen_type>
+void fill_move_array(MoveArray& moves, const Board& board);
+
+void fill_move_array(MoveArray& moves, const Board& board);
+
+// Checks a move taken from somewhere other than the generator (PV, killers)
+// against the current position, up to leaving the own king in check.
+bool is_pseudo_legal(const Board& board, Move move);
+
+// Tells whether a pseudo-legal move keeps the own king out of check, using
+// the checkers and pins cached in the board.
+bool is_legal(const Board& board, Move move);
+
+// Rebuilds a move stored with Move::to_compact() in the current position, or
+// returns an empty move when its from square is empty. The result still has
+// to pass is_pseudo_legal.
+Move move_from_compact(const Board& board, uint16_t compact);
@@ -0,0 +1,173 @@
+#include "move_picker.hpp"
+
+MovePicker::MovePicker(const Board& board, Move hashMove, Move killer1, Move killer2,
+                       const HistoryTable& history)
+  : board(board),
+    history(&history),
+    hashMove(hashMove),
+    killers{killer1, killer2},
+    quiescence(false),
+    inCheck(board.in_check()),
+    stage(Stage::HASH_MOVE),
+    current(0),
+    captureEnd(0),
+    badCaptureEnd(0),
+    killerIndex(0) {
+  if (!is_pseudo_legal(board, hashMove) || !is_legal(board, hashMove)) {
+    this->hashMove = Move{};
+  }
+}
+
+MovePicker::MovePicker(const Board& board, Move hashMove)
+  : board(board),
+    history(nullptr),
+    hashMove(hashMove),
+    killers{},
+    quiescence(true),
+    inCheck(false),
+    stage(Stage::HASH_MOVE),
+    current(0),
+    captureEnd(0),
+    badCaptureEnd(0),
+    killerIndex(0) {
+  if (!hashMove.is_capture() || !is_pseudo_legal(board, hashMove) || !is_legal(board, hashMove)) {
+    this->hashMove = Move{};
+  }
+}
+
+// Moves searched in the capture stages. Quiescence only looks at real
+// captures, the main search also pulls promotions forward.
+bool MovePicker::isTacticalMove(Move move) const {
+  return move.is_capture() || (!quiescence && move.is_promo());
+}
+
+// Generates and scores the tactical moves by MVV-LVA. In check the evasions
+// are generated in one go and partitioned, tactical ones first; the quiet
+// ones stay behind captureEnd for the quiet stage.
+void MovePicker::generateCaptures() {
+  if (inCheck) {
+    fill_move_array<GenType::evasions>(moves, board);
+  } else {
+    fill_move_array<GenType::captures>(moves, board);
+  }
+
+  captureEnd = 0;
+  for (size_t i = 0; i < moves.size(); ++i) {
+    const Move move = moves.get(i);
+    if (!isTacticalMove(move)) {
+      continue;
+    }
+
+    int victimValue = 0;
+    if (move.is_enpassant()) {
+      victimValue = piece_values[static_cast<int>(PieceType::pawn)];
+    } else if (move.is_capture()) {
+      victimValue = piece_values[board.piece_on(move.get_to_sq()) % NUMBER_OF_UNIQUE_PIECES];
+    }
+    if (move.is_promo()) {
+      victimValue += piece_values[static_cast<int>(move.get_prom_piece())];
+    }
+
+    moves.swap(i, captureEnd);
+    moves.set_score(captureEnd, victimValue * 8 - static_cast<int>(move.get_piece()));
+    ++captureEnd;
+  }
+}
+
+void MovePicker::generateQuiets() {
+  if (!inCheck) {
+    fill_move_array<GenType::quiets>(moves, board);
+  }
+
+  for (size_t i = captureEnd; i < moves.size(); ++i) {
+    const Move move = moves.get(i);
+    moves.set_score(i, (*history)[static_cast<int>(move.get_piece())][move.get_to_sq()]);
+  }
+}
+
+Move MovePicker::nextMove() {
+  switch (stage) {
+    case Stage::HASH_MOVE:
+      stage = Stage::GENERATE_CAPTURES;
+      if (hashMove.get_body()) {
+        return hashMove;
+      }
+      [[fallthrough]];
+
+    case Stage::GENERATE_CAPTURES:
+      generateCaptures();
+      current = 0;
+      stage = Stage::GOOD_CAPTURES;
+      [[fallthrough]];
+
+    case Stage::GOOD_CAPTURES:
+      while (current < captureEnd) {
+        const Move move = moves.select_best(current, captureEnd);
+        ++current;
+
+        if (move == hashMove) {
+          continue;
+        }
+
+        // Losing captures are parked at the front of the array, behind the
+        // moves already handed out, and tried after the quiets.
+        if (!quiescence && !board.see_ge(move, 0)) {
+          moves.swap(badCaptureEnd++, current - 1);
+          continue;
+        }
+
+        return move;
+      }
+
+      if (quiescence) {
+        stage = Stage::DONE;
+        return Move{};
+      }
+      stage = Stage::KILLERS;
+      [[fallthrough]];
+
+    case Stage::KILLERS:
+      while (killerIndex < killers.size()) {
+        const Move killer = killers[killerIndex++];
+
+        if (killer.get_body() && killer != hashMove && !isTacticalMove(killer) &&
+            (killerIndex == 1 || killer != killers[0]) &&
+            is_pseudo_legal(board, killer) && is_legal(board, killer)) {
+          return killer;
+        }
+      }
+      stage = Stage::GENERATE_QUIETS;
+      [[fallthrough]];
+
+    case Stage::GENERATE_QUIETS:
+      generateQuiets();
+      current = captureEnd;
+      stage = Stage::QUIETS;
+      [[fallthrough]];
+
+    case Stage::QUIETS:
+      while (current < moves.size()) {
+        const Move move = moves.select_best(current, moves.size());
+        ++current;
+
+        if (move != hashMove && move != killers[0] && move != killers[1]) {
+          return move;
+        }
+      }
+      current = 0;
+      stage = Stage::BAD_CAPTURES;
+      [[fallthrough]];
+
+    case Stage::BAD_CAPTURES:
+      if (current < badCaptureEnd) {
+        return moves.get(current++);
+      }
+      stage = Stage::DONE;
+      [[fallthrough]];
+
+    case Stage::DONE:
+      break;
+  }
+
+  return Move{};
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include "board.hpp"
+#include "move_array.hpp"
+#include "move_generator.hpp"
+
+using HistoryTable = std::array<std::array<int, 64>, 12>;
+
+// Hands out the moves of a node one at a time, best guess first. Each stage
+// only does its work (generating, scoring, selecting) once the previous one
+// is exhausted, so a node that fails high early skips the rest.
+class MovePicker {
+public:
+  // Main search: hash move, good captures, killers, quiets, bad captures.
+  // In check only evasions are generated, captures among them first.
+  MovePicker(const Board& board, Move hashMove, Move killer1, Move killer2, const HistoryTable& history);
+  // Quiescence search: captures only, most valuable victim first.
+  MovePicker(const Board& board, Move hashMove);
+
+  // Returns the next move, or an empty Move once the node is exhausted.
+  Move nextMove();
+
+private:
+  enum class Stage {
+    HASH_MOVE,
+    GENERATE_CAPTURES,
+    GOOD_CAPTURES,
+    KILLERS,
+    GENERATE_QUIETS,
+    QUIETS,
+    BAD_CAPTURES,
+    DONE
+  };
+
+  const Board& board;
+  const HistoryTable* history;
+  Move hashMove;
+  std::array<Move, 2> killers;
+  bool quiescence;
+  bool inCheck;
+
+  Stage stage;
+  MoveArray moves;
+  size_t current;
+  size_t captureEnd;
+  size_t badCaptureEnd;
+  size_t killerIndex;
+
+  bool isTacticalMove(Move move) const;
+  void generateCaptures();
+  void generateQuiets();
+};
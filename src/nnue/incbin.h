@@ -0,0 +1,56 @@
+#ifndef INCBIN_H
+#define INCBIN_H
+
+/*
+Builds a file into the read-only data of the binary with the assembler's
+.incbin directive. INCBIN_ALIGNED(Name, "path", align, offset) places the
+data offset bytes past an align-byte boundary and declares
+
+    const unsigned char gNameData[];   first byte
+    const unsigned char gNameEnd[];    one past the last byte
+    const unsigned int gNameSize;      size in bytes
+
+A relative path is resolved from the compiler's working directory, so build
+systems should pass an absolute one.
+*/
+
+#if defined(__APPLE__)
+#  define INCBIN_SECTION ".const_data\n"
+#  define INCBIN_MANGLE "_"
+#else
+#  define INCBIN_SECTION ".section .rodata\n"
+#  define INCBIN_MANGLE ""
+#endif
+
+#define INCBIN_STR2(x) #x
+#define INCBIN_STR(x) INCBIN_STR2(x)
+#define INCBIN_SYM(name, part) INCBIN_MANGLE "g" #name #part
+
+#ifdef __cplusplus
+#  define INCBIN_EXTERN extern "C"
+#else
+#  define INCBIN_EXTERN extern
+#endif
+
+#define INCBIN_ALIGNED(name, file, align, offset) \
+  __asm__(INCBIN_SECTION \
+          ".balign " INCBIN_STR(align) "\n" \
+          ".skip " INCBIN_STR(offset) "\n" \
+          ".globl " INCBIN_SYM(name, Data) "\n" \
+          INCBIN_SYM(name, Data) ":\n" \
+          ".incbin \"" file "\"\n" \
+          ".globl " INCBIN_SYM(name, End) "\n" \
+          INCBIN_SYM(name, End) ":\n" \
+          ".byte 0\n" \
+          ".balign 4\n" \
+          ".globl " INCBIN_SYM(name, Size) "\n" \
+          INCBIN_SYM(name, Size) ":\n" \
+          ".int " INCBIN_SYM(name, End) " - " INCBIN_SYM(name, Data) "\n" \
+          ".text\n"); \
+  INCBIN_EXTERN const unsigned char g##name##Data[]; \
+  INCBIN_EXTERN const unsigned char g##name##End[]; \
+  INCBIN_EXTERN const unsigned int g##name##Size
+
+#define INCBIN(name, file) INCBIN_ALIGNED(name, file, 16, 0)
+
+#endif
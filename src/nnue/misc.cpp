@@ -62,6 +62,33 @@ const void *map_file(FD fd, map_t *map)
 #endif
 }
 
+// Maps a file copy-on-write: pages are read in when first touched and what
+// is written to them stays in the process.
+void *map_file_private(FD fd, map_t *map)
+{
+#ifndef _WIN32
+
+  *map = file_size(fd);
+  void *data = mmap(NULL, *map, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return NULL;
+#ifdef MADV_RANDOM
+  madvise(data, *map, MADV_RANDOM);
+#endif
+  return data;
+
+#else
+
+  DWORD sizeLow, sizeHigh;
+  sizeLow = GetFileSize(fd, &sizeHigh);
+  *map = CreateFileMapping(fd, NULL, PAGE_WRITECOPY, sizeHigh, sizeLow, NULL);
+  if (*map == NULL)
+    return NULL;
+  return MapViewOfFile(*map, FILE_MAP_COPY, 0, 0, 0);
+
+#endif
+}
+
 void unmap_file(const void *data, map_t map)
 {
   if (!data) return;
@@ -78,6 +105,86 @@ void unmap_file(const void *data, map_t map)
 #endif
 }
 
+#define LARGE_PAGE_SIZE ((size_t)2 << 20)
+
+static size_t large_size(size_t size)
+{
+  return size < LARGE_PAGE_SIZE ? size
+       : (size + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+}
+
+void *alloc_large(size_t size, PageKind *kind)
+{
+  *kind = PAGES_SMALL;
+
+#ifndef _WIN32
+
+  const size_t mapSize = large_size(size);
+  void *mem;
+
+  if (mapSize < LARGE_PAGE_SIZE) {
+    mem = mmap(NULL, mapSize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return mem == MAP_FAILED ? NULL : mem;
+  }
+
+#ifdef MAP_HUGETLB
+  mem = mmap(NULL, mapSize, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (mem != MAP_FAILED) {
+    *kind = PAGES_HUGE;
+    return mem;
+  }
+#endif
+
+  // Transparent huge pages only cover aligned 2 MB ranges, so map one more
+  // large page and trim the ends.
+  mem = mmap(NULL, mapSize + LARGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return NULL;
+
+  char *start = (char *)mem;
+  char *aligned = (char *)(((uintptr_t)start + LARGE_PAGE_SIZE - 1)
+      & ~(uintptr_t)(LARGE_PAGE_SIZE - 1));
+  if (aligned > start)
+    munmap(start, aligned - start);
+  if (start + LARGE_PAGE_SIZE > aligned)
+    munmap(aligned + mapSize, start + LARGE_PAGE_SIZE - aligned);
+
+#ifdef MADV_HUGEPAGE
+  if (madvise(aligned, mapSize, MADV_HUGEPAGE) == 0)
+    *kind = PAGES_TRANSPARENT;
+#endif
+  return aligned;
+
+#else
+
+  return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+#endif
+}
+
+void free_large(void *mem, size_t size)
+{
+  if (!mem) return;
+
+#ifndef _WIN32
+  munmap(mem, large_size(size));
+#else
+  (void)size;
+  VirtualFree(mem, 0, MEM_RELEASE);
+#endif
+}
+
+const char *page_kind_name(PageKind kind)
+{
+  switch (kind) {
+    case PAGES_HUGE:        return "huge pages";
+    case PAGES_TRANSPARENT: return "transparent huge pages";
+    default:                return "small pages";
+  }
+}
+
 /*
 FEN
 */
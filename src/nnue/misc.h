@@ -35,8 +35,23 @@ FD open_file(const char *name);
 void close_file(FD fd);
 size_t file_size(FD fd);
 const void *map_file(FD fd, map_t *map);
+void *map_file_private(FD fd, map_t *map);
 void unmap_file(const void *data, map_t map);
 
+// How alloc_large backed a block
+typedef enum {
+  PAGES_SMALL,        // regular pages
+  PAGES_TRANSPARENT,  // regular mapping the kernel was asked to back with huge pages
+  PAGES_HUGE          // reserved huge pages
+} PageKind;
+
+// Zeroed memory for big tables that are read at random, aligned to at
+// least 64 bytes. Blocks of a large page or more try reserved huge pages
+// first and fall back to transparent ones.
+void *alloc_large(size_t size, PageKind *kind);
+void free_large(void *mem, size_t size);
+const char *page_kind_name(PageKind kind);
+
 INLINE uint32_t readu_le_u32(const void *p)
 {
   const uint8_t *q = (const uint8_t*) p;
@@ -3,51 +3,39 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <thread>
+#include <vector>
 
-#if defined(USE_AVX2)
+#if defined(__x86_64__) || defined(__i386__)
+#define NNUE_X86
 #include <immintrin.h>
 
-#elif defined(USE_SSE41)
-#include <smmintrin.h>
-
-#elif defined(USE_SSSE3)
-#include <tmmintrin.h>
-
-#elif defined(USE_SSE2)
-#include <emmintrin.h>
-
-#elif defined(USE_SSE)
-#include <xmmintrin.h>
-
-#elif defined(USE_MMX)
-#include <mmintrin.h>
-
-#elif defined(USE_NEON)
+#elif defined(__ARM_NEON)
+#define NNUE_NEON
 #include <arm_neon.h>
 #endif
 
+#if defined(__x86_64__) || defined(__aarch64__)
+#define IS_64BIT
+#endif
+
 #define DLL_EXPORT
 #include "nnue.h"
 #undef DLL_EXPORT
 
 #ifdef NNUE_EMBEDDED
 #include "incbin.h"
-INCBIN(Network, DefaultEvalFile);
-#endif
-
-// Old gcc on Windows is unable to provide a 32-byte aligned stack.
-// We need to hack around this when using AVX2 and AVX512.
-#if     defined(__GNUC__ ) && (__GNUC__ < 9) && defined(_WIN32) \
-    && !defined(__clang__) && !defined(__INTEL_COMPILER) \
-    &&  defined(USE_AVX2)
-#define ALIGNMENT_HACK
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The embedded network is used in place and needs a little-endian target"
 #endif
-
-#if defined(USE_NEON) && !defined(IS_64BIT)
-INLINE int16x8_t vmovl_high_s16(int8x16_t v)
-{
-  return vmovl_s16(vget_high_s16(v));
-}
+// Puts the feature transformer of the embedded file on a 64-byte boundary
+#define NNUE_EMBEDDED_PAD 63
+INCBIN_ALIGNED(Network, NNUE_EMBEDDED_PATH, 64, NNUE_EMBEDDED_PAD);
 #endif
 
 enum {
@@ -81,89 +69,19 @@ enum {
 };
 
 enum {
-  kHalfDimensions = 256,
   FtInDims = 64 * PS_END, // 64 * 641
-  FtOutDims = kHalfDimensions * 2
+  MaxBuckets = 16,
+  MaxNetworkSize = 64 * 1024 // of one layer stack, in any kernel
 };
 
-// USE_MMX generates _mm_empty() instructions, so undefine if not needed
-#if defined(USE_SSE2)
-#undef USE_MMX
-#endif
-
-static_assert(kHalfDimensions % 256 == 0, "kHalfDimensions should be a multiple of 256");
-
-#define VECTOR
-
-#ifdef USE_AVX512
-#define SIMD_WIDTH 512
-typedef __m512i vec16_t;
-typedef __m512i vec8_t;
-typedef __mmask64 mask_t;
-#define vec_add_16(a,b) _mm512_add_epi16(a,b)
-#define vec_sub_16(a,b) _mm512_sub_epi16(a,b)
-#define vec_packs(a,b) _mm512_packs_epi16(a,b)
-#define vec_mask_pos(a) _mm512_cmpgt_epi8_mask(a,_mm512_setzero_si512())
-#define NUM_REGS 8 // only 8 are needed
-
-#elif USE_AVX2
-#define SIMD_WIDTH 256
-typedef __m256i vec16_t;
-typedef __m256i vec8_t;
-typedef uint32_t mask_t;
-#define vec_add_16(a,b) _mm256_add_epi16(a,b)
-#define vec_sub_16(a,b) _mm256_sub_epi16(a,b)
-#define vec_packs(a,b) _mm256_packs_epi16(a,b)
-#define vec_mask_pos(a) _mm256_movemask_epi8(_mm256_cmpgt_epi8(a,_mm256_setzero_si256()))
-#define NUM_REGS 16
-
-#elif USE_SSE2
-#define SIMD_WIDTH 128
-typedef __m128i vec16_t;
-typedef __m128i vec8_t;
-typedef uint16_t mask_t;
-#define vec_add_16(a,b) _mm_add_epi16(a,b)
-#define vec_sub_16(a,b) _mm_sub_epi16(a,b)
-#define vec_packs(a,b) _mm_packs_epi16(a,b)
-#define vec_mask_pos(a) _mm_movemask_epi8(_mm_cmpgt_epi8(a,_mm_setzero_si128()))
-#ifdef IS_64BIT
-#define NUM_REGS 16
-#else
-#define NUM_REGS 8
-#endif
-
-#elif USE_MMX
-#define SIMD_WIDTH 64
-typedef __m64 vec16_t;
-typedef __m64 vec8_t;
-typedef uint8_t mask_t;
-#define vec_add_16(a,b) _mm_add_pi16(a,b)
-#define vec_sub_16(a,b) _mm_sub_pi16(a,b)
-#define vec_packs(a,b) _mm_packs_pi16(a,b)
-#define vec_mask_pos(a) _mm_movemask_pi8(_mm_cmpgt_pi8(a,_mm_setzero_si64()))
-#define NUM_REGS 8
-
-#elif USE_NEON
-#define SIMD_WIDTH 128
-typedef int16x8_t vec16_t;
-typedef int8x16_t vec8_t;
-typedef uint16_t mask_t;
-#define vec_add_16(a,b) vaddq_s16(a,b)
-#define vec_sub_16(a,b) vsubq_s16(a,b)
-#define vec_packs(a,b) vcombine_s8(vqmovn_s16(a),vqmovn_s16(b))
-#define vec_mask_pos(a) neon_movemask(vcgtq_s8(a,vdupq_n_u8(0)))
-#ifdef IS_64BIT
-#define NUM_REGS 16
-#else
-#define NUM_REGS 8
-#endif
+// Accumulator widths the kernels are compiled for, see nnue_shapes.h. Each
+// is a HalfKP feature transformer followed by 32-32-1 layer stacks.
+static const unsigned HalfDimensions[] = { 256, 128 };
 
-#else
-#undef VECTOR
-#define SIMD_WIDTH 16 // dummy
-typedef uint8_t mask_t; // dummy
-
-#endif
+// Positions that go through the layers together in nnue_evaluate_batch
+enum {
+  BatchBlock = 64
+};
 
 #ifdef IS_64BIT
 typedef uint64_t mask2_t;
@@ -172,11 +90,6 @@ typedef uint32_t mask2_t;
 #endif
 
 typedef int8_t clipped_t;
-#if defined(USE_MMX) || (defined(USE_SSE2) && !defined(USE_AVX2))
-typedef int16_t weight_t;
-#else
-typedef int8_t weight_t;
-#endif
 
 typedef struct {
   size_t size;
@@ -188,29 +101,44 @@ INLINE int orient(int c, int s)
   return s ^ (c == white ? 0x00 : 0x3f);
 }
 
+// Feature index of each piece on each square, relative to the king
+// square's block, for both perspectives. Filled in by nnue_init.
+static uint32_t PieceSquareIndex[2][13][64];
+
+static void init_index_tables(void)
+{
+  for (int c = 0; c < 2; c++)
+    for (int pc = 0; pc < 13; pc++)
+      for (int s = 0; s < 64; s++)
+        PieceSquareIndex[c][pc][s] = orient(c, s) + PieceToIndex[c][pc];
+}
+
+INLINE int king_square(const Position *pos, int c)
+{
+  return __builtin_ctzll(pos->pieceBB[COMBINE(c, king)]);
+}
+
 INLINE unsigned make_index(int c, int s, int pc, int ksq)
 {
-  return orient(c, s) + PieceToIndex[c][pc] + PS_END * ksq;
+  return PieceSquareIndex[c][pc][s] + PS_END * ksq;
 }
 
 static void half_kp_append_active_indices(const Position *pos, const int c,
     IndexList *active)
 {
-  int ksq = pos->squares[c ? 1 : 0];
-  ksq = orient(c, ksq);
-  for (int i = 2; pos->pieces[i]; i++) {
-    int sq = pos->squares[i];
-    int pc = pos->pieces[i];
-    active->values[active->size++] = make_index(c, sq, pc, ksq);
+  int ksq = orient(c, king_square(pos, c));
+  for (int pc = 1; pc < 13; pc++) {
+    if (PIECE(pc) == king) continue;
+    for (uint64_t b = pos->pieceBB[pc]; b; b &= b - 1)
+      active->values[active->size++] =
+          make_index(c, __builtin_ctzll(b), pc, ksq);
   }
 }
 
-#if 0
 static void half_kp_append_changed_indices(const Position *pos, const int c,
     const DirtyPiece *dp, IndexList *removed, IndexList *added)
 {
-  int ksq = pos->squares[c ? 1 : 0];
-  ksq = orient(c, ksq);
+  int ksq = orient(c, king_square(pos, c));
   for (int i = 0; i < dp->dirtyNum; i++) {
     int pc = dp->pc[i];
     if (PIECE(pc) == king) continue;
@@ -220,1048 +148,612 @@ static void half_kp_append_changed_indices(const Position *pos, const int c,
       added->values[added->size++] = make_index(c, dp->to[i], pc, ksq);
   }
 }
-#endif
 
-static void append_active_indices(const Position *pos, IndexList active[2])
+// Bitboards of a position in the piece list format of nnue_evaluate
+static void piece_list_to_bitboards(const int* pieces, const int* squares,
+    uint64_t *pieceBB)
 {
-  for (unsigned c = 0; c < 2; c++)
-    half_kp_append_active_indices(pos, c, &active[c]);
+  memset(pieceBB, 0, 13 * sizeof(uint64_t));
+  pieceBB[COMBINE(white, king)] = 1ULL << squares[0];
+  pieceBB[COMBINE(black, king)] = 1ULL << squares[1];
+  for (int i = 2; pieces[i]; i++)
+    pieceBB[pieces[i]] |= 1ULL << squares[i];
 }
 
-#if 0
-static void append_changed_indices(const Position *pos, IndexList removed[2],
-    IndexList added[2], bool reset[2])
+// Input feature converter, inside the parameter block in use
+static const int16_t *ft_biases;
+static const int16_t *ft_weights;
+
+INLINE bool is_king_move(const DirtyPiece *dp, const int c)
 {
-  const DirtyPiece *dp = &(pos->hstack[pos->hply].dirtyPiece);
-  assert(dp->dirtyNum != 0);
-
-  if (pos->hstack[pos->hply-1].accumulator.computedAccumulation) {
-    for (unsigned c = 0; c < 2; c++) {
-      reset[c] = dp->pc[0] == (int)COMBINE(c, king);
-      if (reset[c])
-        half_kp_append_active_indices(pos, c, &added[c]);
-      else
-        half_kp_append_changed_indices(pos, c, dp, &removed[c], &added[c]);
-    }
-  } else {
-    const DirtyPiece *dp2 = &(pos->hstack[pos->hply-1].dirtyPiece);
-    for (unsigned c = 0; c < 2; c++) {
-      reset[c] =   dp->pc[0] == (int)COMBINE(c, king)
-                || dp2->pc[0] == (int)COMBINE(c, king);
-      if (reset[c])
-        half_kp_append_active_indices(pos, c, &added[c]);
-      else {
-        half_kp_append_changed_indices(pos, c, dp, &removed[c], &added[c]);
-        half_kp_append_changed_indices(pos, c, dp2, &removed[c], &added[c]);
-      }
-    }
-  }
+  return dp->dirtyNum != 0 && dp->pc[0] == (int)COMBINE(c, king);
 }
-#endif
-
-// InputLayer = InputSlice<256 * 2>
-// out: 512 x clipped_t
 
-// Hidden1Layer = ClippedReLu<AffineTransform<InputLayer, 32>>
-// 512 x clipped_t -> 32 x int32_t -> 32 x clipped_t
+// Layer stack a position goes through. Networks with several stacks (output
+// buckets) split the game into phases by the number of pieces, kings
+// included.
+INLINE unsigned output_bucket(const Position *pos, unsigned buckets)
+{
+  if (buckets == 1) return 0;
 
-// Hidden2Layer = ClippedReLu<AffineTransform<hidden1, 32>>
-// 32 x clipped_t -> 32 x int32_t -> 32 x clipped_t
+  int pieces = 0;
+  for (int pc = 1; pc < 13; pc++)
+    pieces += __builtin_popcountll(pos->pieceBB[pc]);
+  if (pieces > 32) pieces = 32;
+  return (pieces - 1) * buckets / 32;
+}
 
-// OutputLayer = AffineTransform<HiddenLayer2, 1>
-// 32 x clipped_t -> 1 x int32_t
 
-#if !defined(USE_AVX512)
-static weight_t hidden1_weights alignas(64) [32 * 512];
-static weight_t hidden2_weights alignas(64) [32 * 32];
+// The kernels are compiled once per instruction set and accumulator width
+// with function-level target attributes, so the binary runs everywhere and
+// loading a network picks the widest set the CPU supports for its width.
+#define NNUE_STR(x) #x
+#if defined(__clang__)
+#define NNUE_TARGET_PUSH(t) \
+  _Pragma(NNUE_STR(clang attribute push(__attribute__((target(t))), apply_to = function)))
+#define NNUE_TARGET_POP() _Pragma("clang attribute pop")
 #else
-static weight_t hidden1_weights alignas(64) [64 * 512];
-static weight_t hidden2_weights alignas(64) [64 * 32];
+#define NNUE_TARGET_PUSH(t) \
+  _Pragma("GCC push_options") _Pragma(NNUE_STR(GCC target(t)))
+#define NNUE_TARGET_POP() _Pragma("GCC pop_options")
 #endif
-static weight_t output_weights alignas(64) [1 * 32];
-
-static int32_t hidden1_biases alignas(64) [32];
-static int32_t hidden2_biases alignas(64) [32];
-static int32_t output_biases[1];
 
-INLINE int32_t affine_propagate(clipped_t *input, int32_t *biases,
-    weight_t *weights)
-{
-#if defined(USE_AVX2)
-  __m256i *iv = (__m256i *)input;
-  __m256i *row = (__m256i *)weights;
-#if defined(USE_VNNI)
-  __m256i prod = _mm256_dpbusd_epi32(_mm256_setzero_si256(), iv[0], row[0]);
-#else
-  __m256i prod = _mm256_maddubs_epi16(iv[0], row[0]);
-  prod = _mm256_madd_epi16(prod, _mm256_set1_epi16(1));
-#endif
-  __m128i sum = _mm_add_epi32(
-      _mm256_castsi256_si128(prod), _mm256_extracti128_si256(prod, 1));
-  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x1b));
-  return _mm_cvtsi128_si32(sum) + _mm_extract_epi32(sum, 1) + biases[0];
-
-#elif defined(USE_SSE2)
-  __m128i *iv = (__m128i *)input;
-  __m128i *row = (__m128i *)weights;
-#if defined(AVOID_USE_SSSE3)
-  const __m128i kOnes = _mm_set1_epi16(1);
-  __m128i p0 = _mm_madd_epi16(_mm_maddubs_epi16(iv[0], row[0]), kOnes);
-  __m128i p1 = _mm_madd_epi16(_mm_maddubs_epi16(iv[1], row[1]), kOnes);
-  __m128i sum = _mm_add_epi32(p0, p1);
-#else
-  __m128i p0 = _mm_madd_epi16(iv[0], row[0]);
-  __m128i p1 = _mm_madd_epi16(iv[1], row[1]);
-  __m128i p2 = _mm_madd_epi16(iv[2], row[2]);
-  __m128i p3 = _mm_madd_epi16(iv[3], row[3]);
-  __m128i sum = _mm_add_epi32(_mm_add_epi32(p0, p1), _mm_add_epi32(p2, p3));
-#endif
-  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb));
-#if defined(USE_SSE41)
-  return _mm_cvtsi128_si32(sum) + _mm_extract_epi32(sum, 1) + biases[0];
-#else
-  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x1));
-  return _mm_cvtsi128_si32(sum) + biases[0];
-#endif
-
-#elif defined(USE_MMX)
-  __m64 *iv = (__m64 *)input;
-  __m64 s0 = _mm_setzero_si64(), s1 = s0;
-  __m64 *row = (__m64 *)weights;
-  for (unsigned j = 0; j < 4; j++) {
-    s0 = _mm_add_pi32(s0, _mm_madd_pi16(row[2 * j], iv[2 * j]));
-    s1 = _mm_add_pi32(s1, _mm_madd_pi16(row[2 * j + 1], iv[2 * j + 1]));
-  }
-  __m64 sum = _mm_add_pi32(s0, s1);
-  sum = _mm_add_pi32(sum, _mm_unpackhi_pi32(sum, sum));
-  return _mm_cvtsi64_si32(sum) + biases[0];
-
-#elif defined(USE_NEON)
-  int8x8_t *iv = (int8x8_t *)input;
-  int32x4_t sum = {biases[0]};
-  int8x8_t *row = (int8x8_t *)weights;
-  int16x8_t p0 = vmull_s8(iv[0], row[0]);
-  int16x8_t p1 = vmull_s8(iv[1], row[1]);
-  p0 = vmlal_s8(p0, iv[2], row[2]);
-  sum = vpadalq_s16(sum, p0);
-  p1 = vmlal_s8(p1, iv[3], row[3]);
-  sum = vpadalq_s16(sum, p1);
-  return sum[0] + sum[1] + sum[2] + sum[3];
-
-#else
-  int32_t sum = biases[0];
-  for (unsigned j = 0; j < 32; j++)
-    sum += weights[j] * input[j];
-  return sum;
-
-#endif
+#if defined(NNUE_X86)
+NNUE_TARGET_PUSH("avx2")
+namespace avx2 {
+#define USE_AVX2 1
+#define USE_SSE41 1
+#define USE_SSSE3 1
+#define USE_SSE2 1
+#include "nnue_shapes.h"
+#undef USE_AVX2
+#undef USE_SSE41
+#undef USE_SSSE3
+#undef USE_SSE2
 }
+NNUE_TARGET_POP()
 
-static_assert(FtOutDims % 64 == 0, "FtOutDims not a multiple of 64");
-
-#ifdef VECTOR
-INLINE bool next_idx(unsigned *idx, unsigned *offset, mask2_t *v,
-    mask_t *mask, unsigned inDims)
-{
-  while (*v == 0) {
-    *offset += 8 * sizeof(mask2_t);
-    if (*offset >= inDims) return false;
-    memcpy(v, (char *)mask + (*offset / 8), sizeof(mask2_t));
-  }
-#ifdef IS_64BIT
-  *idx = *offset + __builtin_ctzll(*v);
-#else
-  *idx = *offset + __builtin_ctzl(*v);
-#endif
-  *v &= *v - 1;
-  return true;
+NNUE_TARGET_PUSH("sse4.1")
+namespace sse41 {
+#define USE_SSE41 1
+#define USE_SSSE3 1
+#define USE_SSE2 1
+#include "nnue_shapes.h"
+#undef USE_SSE41
+#undef USE_SSSE3
+#undef USE_SSE2
 }
+NNUE_TARGET_POP()
 
-#if defined(USE_MMX) && !defined(USE_SSE)
-INLINE int _mm_movemask_pi8(__m64 v)
-{
-  const __m64 powers = _mm_set_pi8(-128, 64, 32, 16, 8, 4, 2, 1);
-  __m64 m = _mm_and_si64(v, powers);
-  m = _mm_or_si64(m, _mm_srli_si64(m, 32));
-  m = _mm_or_si64(m, _mm_srli_pi32(m, 16));
-  m = _mm_or_si64(m, _mm_srli_pi16(m, 8));
-  return _mm_cvtsi64_si32(m) & 0xff;
+NNUE_TARGET_PUSH("sse2")
+namespace sse2 {
+#define USE_SSE2 1
+#include "nnue_shapes.h"
+#undef USE_SSE2
 }
-#elif defined(USE_NEON)
-INLINE int neon_movemask(uint8x16_t v)
-{
-  const uint8_t __attribute__((aligned(16))) powers[16] =
-    { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
-  const uint8x16_t kPowers = vld1q_u8(powers);
+NNUE_TARGET_POP()
 
-  uint64x2_t mask = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vandq_u8(v, kPowers))));
-  return   vgetq_lane_u8((uint8x16_t)mask, 0)
-        | (vgetq_lane_u8((uint8x16_t)mask, 8) << 8);
+#elif defined(NNUE_NEON)
+namespace neon {
+#define USE_NEON 1
+#include "nnue_shapes.h"
+#undef USE_NEON
 }
 #endif
-#endif
 
-#if defined(USE_AVX512)
-INLINE void affine_txfm(int8_t *input, void *output, unsigned inDims,
-    unsigned outDims, const int32_t *biases, const weight_t *weights,
-    mask_t *inMask, mask_t *outMask, const bool pack8_and_calc_mask)
-{
-  assert(outDims == 32);
-
-  (void)outDims;
-  const __m512i kZero = _mm512_setzero_si512();
-  __m512i out_0 = ((__m512i *)biases)[0];
-  __m512i out_1 = ((__m512i *)biases)[1];
-  __m512i first, second;
-  mask2_t v;
-  unsigned idx;
-
-  memcpy(&v, inMask, sizeof(mask2_t));
-  for (unsigned offset = 0; offset < inDims;) {
-    if (!next_idx(&idx, &offset, &v, inMask, inDims))
-      break;
-    first = ((__m512i *)weights)[idx];
-    uint16_t factor = input[idx];
-    if (next_idx(&idx, &offset, &v, inMask, inDims)) {
-      second = ((__m512i *)weights)[idx];
-      factor |= input[idx] << 8;
-    } else {
-      second = kZero;
-    }
-    __m512i mul = _mm512_set1_epi16(factor), prod, signs;
-    prod = _mm512_maddubs_epi16(mul, _mm512_unpacklo_epi8(first, second));
-    signs = _mm512_srai_epi16(prod, 15);
-    out_0 = _mm512_add_epi32(out_0, _mm512_unpacklo_epi16(prod, signs));
-    out_1 = _mm512_add_epi32(out_1, _mm512_unpackhi_epi16(prod, signs));
-  }
-
-  __m512i out16 = _mm512_srai_epi16(_mm512_packs_epi32(out_0, out_1), SHIFT);
-
-  __m256i *outVec = (__m256i *)output;
-  const __m256i kZero256 = _mm256_setzero_si256();
-  outVec[0] = _mm256_packs_epi16(
-      _mm512_castsi512_si256(out16),_mm512_extracti64x4_epi64(out16, 1));
-  if (pack8_and_calc_mask)
-    outMask[0] = (uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(outVec[0], kZero256));
-  else
-    outVec[0] = _mm256_max_epi8(outVec[0], kZero256);
+namespace generic {
+#include "nnue_shapes.h"
 }
-#elif defined(USE_AVX2)
-INLINE void affine_txfm(int8_t *input, void *output, unsigned inDims,
-    unsigned outDims, const int32_t *biases, const weight_t *weights,
-    mask_t *inMask, mask_t *outMask, const bool pack8_and_calc_mask)
-{
-  assert(outDims == 32);
-
-  (void)outDims;
-  const __m256i kZero = _mm256_setzero_si256();
-  __m256i out_0 = ((__m256i *)biases)[0];
-  __m256i out_1 = ((__m256i *)biases)[1];
-  __m256i out_2 = ((__m256i *)biases)[2];
-  __m256i out_3 = ((__m256i *)biases)[3];
-  __m256i first, second;
-  mask2_t v;
-  unsigned idx;
-
-  memcpy(&v, inMask, sizeof(mask2_t));
-  for (unsigned offset = 0; offset < inDims;) {
-    if (!next_idx(&idx, &offset, &v, inMask, inDims))
-      break;
-    first = ((__m256i *)weights)[idx];
-    uint16_t factor = input[idx];
-    if (next_idx(&idx, &offset, &v, inMask, inDims)) {
-      second = ((__m256i *)weights)[idx];
-      factor |= input[idx] << 8;
-    } else {
-      second = kZero;
-    }
-    __m256i mul = _mm256_set1_epi16(factor), prod, signs;
-    prod = _mm256_maddubs_epi16(mul, _mm256_unpacklo_epi8(first, second));
-    signs = _mm256_cmpgt_epi16(kZero, prod);
-    out_0 = _mm256_add_epi32(out_0, _mm256_unpacklo_epi16(prod, signs));
-    out_1 = _mm256_add_epi32(out_1, _mm256_unpackhi_epi16(prod, signs));
-    prod = _mm256_maddubs_epi16(mul, _mm256_unpackhi_epi8(first, second));
-    signs = _mm256_cmpgt_epi16(kZero, prod);
-    out_2 = _mm256_add_epi32(out_2, _mm256_unpacklo_epi16(prod, signs));
-    out_3 = _mm256_add_epi32(out_3, _mm256_unpackhi_epi16(prod, signs));
-  }
 
-  __m256i out16_0 = _mm256_srai_epi16(_mm256_packs_epi32(out_0, out_1), SHIFT);
-  __m256i out16_1 = _mm256_srai_epi16(_mm256_packs_epi32(out_2, out_3), SHIFT);
+typedef struct {
+  const char *name;
+  unsigned halfDims;
+  bool (*supported)(void);
+  int (*evaluate_pos)(Position *pos);
+  void (*evaluate_block)(Position *pos, unsigned count, int *scores);
+  size_t networkSize;   // of one layer stack
+  void (*read_network)(const char *d, void *dst);
+  void (*use_network)(const void *src, unsigned buckets);
+} Kernel;
+
+#if defined(NNUE_X86)
+static bool cpu_has_avx2(void) { return __builtin_cpu_supports("avx2"); }
+static bool cpu_has_sse41(void) { return __builtin_cpu_supports("sse4.1"); }
+static bool cpu_has_sse2(void) { return __builtin_cpu_supports("sse2"); }
+#endif
+static bool cpu_has_baseline(void) { return true; }
+
+#define NNUE_KERNEL(ns, name, supported, dims) \
+  { name, dims, supported, ns::w##dims::evaluate_pos, \
+    ns::w##dims::evaluate_block, sizeof(ns::w##dims::Network), \
+    ns::w##dims::read_network, ns::w##dims::use_network }
+#define NNUE_KERNELS(ns, name, supported) \
+  NNUE_KERNEL(ns, name, supported, 256), NNUE_KERNEL(ns, name, supported, 128)
+
+// Widest first; the last ones run on any CPU.
+static const Kernel kernels[] = {
+#if defined(NNUE_X86)
+  NNUE_KERNELS(avx2, "avx2", cpu_has_avx2),
+  NNUE_KERNELS(sse41, "sse4.1", cpu_has_sse41),
+  NNUE_KERNELS(sse2, "sse2", cpu_has_sse2),
+#elif defined(NNUE_NEON)
+  NNUE_KERNELS(neon, "neon", cpu_has_baseline),
+#endif
+  NNUE_KERNELS(generic, "generic", cpu_has_baseline)
+};
 
-  __m256i *outVec = (__m256i *)output;
-  outVec[0] = _mm256_packs_epi16(out16_0, out16_1);
-  if (pack8_and_calc_mask)
-    outMask[0] = _mm256_movemask_epi8(_mm256_cmpgt_epi8(outVec[0], kZero));
-  else
-    outVec[0] = _mm256_max_epi8(outVec[0], kZero);
-}
-#elif AVOID_USE_SSSE3
-INLINE void affine_txfm(int8_t *input, void *output, unsigned inDims,
-    unsigned outDims, const int32_t *biases, const weight_t *weights,
-    mask_t *inMask, mask_t *outMask, const bool pack8_and_calc_mask)
-{
-  assert(outDims == 32);
-
-  const __m128i kZeros[2] = { 0 };
-  __m128i out_0 = ((__m128i *)biases)[0];
-  __m128i out_1 = ((__m128i *)biases)[1];
-  __m128i out_2 = ((__m128i *)biases)[2];
-  __m128i out_3 = ((__m128i *)biases)[3];
-  __m128i out_4 = ((__m128i *)biases)[4];
-  __m128i out_5 = ((__m128i *)biases)[5];
-  __m128i out_6 = ((__m128i *)biases)[6];
-  __m128i out_7 = ((__m128i *)biases)[7];
-  const __m128i *first, *second;
-  mask2_t v;
-  unsigned idx;
-
-  memcpy(&v, inMask, sizeof(mask2_t));
-  for (unsigned offset = 0; offset < inDims;) {
-    if (!next_idx(&idx, &offset, &v, inMask, inDims))
-      break;
-    first = (__m128i *)&weights[outDims * idx];
-    uint16_t factor = input[idx];
-    if (next_idx(&idx, &offset, &v, inMask, inDims)) {
-      second = (__m128i *)&weights[outDims * idx];
-      factor |= input[idx] << 8;
-    } else {
-      second = kZeros;
-    }
-    __m128i mul = _mm_set1_epi16(factor), prod, signs;
-    prod = _mm_maddubs_epi16(mul, _mm_unpacklo_epi8(first[0], second[0]));
-    signs = _mm_cmpgt_epi16(kZeros[0], prod);
-    out_0 = _mm_add_epi32(out_0, _mm_unpacklo_epi16(prod, signs));
-    out_1 = _mm_add_epi32(out_1, _mm_unpackhi_epi16(prod, signs));
-    prod = _mm_maddubs_epi16(mul, _mm_unpackhi_epi8(first[0], second[0]));
-    signs = _mm_cmpgt_epi16(kZeros[0], prod);
-    out_2 = _mm_add_epi32(out_2, _mm_unpacklo_epi16(prod, signs));
-    out_3 = _mm_add_epi32(out_3, _mm_unpackhi_epi16(prod, signs));
-    prod = _mm_maddubs_epi16(mul, _mm_unpacklo_epi8(first[1], second[1]));
-    signs = _mm_cmpgt_epi16(kZeros[0], prod);
-    out_4 = _mm_add_epi32(out_4, _mm_unpacklo_epi16(prod, signs));
-    out_5 = _mm_add_epi32(out_5, _mm_unpackhi_epi16(prod, signs));
-    prod = _mm_maddubs_epi16(mul, _mm_unpackhi_epi8(first[1], second[1]));
-    signs = _mm_cmpgt_epi16(kZeros[0], prod);
-    out_6 = _mm_add_epi32(out_6, _mm_unpacklo_epi16(prod, signs));
-    out_7 = _mm_add_epi32(out_7, _mm_unpackhi_epi16(prod, signs));
-  }
+// Kernel of the network in use
+static const Kernel *kernel = NULL;
 
-  __m128i out16_0 = _mm_srai_epi16(_mm_packs_epi32(out_0, out_1), SHIFT);
-  __m128i out16_1 = _mm_srai_epi16(_mm_packs_epi32(out_2, out_3), SHIFT);
-  __m128i out16_2 = _mm_srai_epi16(_mm_packs_epi32(out_4, out_5), SHIFT);
-  __m128i out16_3 = _mm_srai_epi16(_mm_packs_epi32(out_6, out_7), SHIFT);
-
-  __m128i *outVec = (__m128i *)output;
-  if (pack8_and_calc_mask) {
-    outVec[0] = _mm_packs_epi16(out16_0, out16_1);
-    outMask[0] = _mm_movemask_epi8(_mm_cmpgt_epi8(outVec[0], kZeros[0]));
-    outVec[1] = _mm_packs_epi16(out16_2, out16_3);
-    outMask[1] = _mm_movemask_epi8(_mm_cmpgt_epi8(outVec[1], kZeros[0]));
-  } else {
-#if defined(USE_SSE41)
-    outVec[0] = _mm_max_epi8(_mm_packs_epi16(out16_0, out16_1), kZeros[0]);
-    outVec[1] = _mm_max_epi8(_mm_packs_epi16(out16_2, out16_3), kZeros[0]);
-#else
-    outVec[0] = _mm_packs_epi16(
-        _mm_max_epi16(out16_0, kZeros[0]), _mm_max_epi16(out16_1, kZeros[0]));
-    outVec[1] = _mm_packs_epi16(
-        _mm_max_epi16(out16_2, kZeros[0]), _mm_max_epi16(out16_3, kZeros[0]));
-#endif
-  }
-}
-#elif defined(USE_SSE2)
-INLINE void affine_txfm(clipped_t *input, void *output, unsigned inDims,
-    unsigned outDims, const int32_t *biases, const weight_t *weights,
-    mask_t *inMask, mask_t *outMask, const bool pack8_and_calc_mask)
+static const Kernel *find_kernel(unsigned halfDims)
 {
-  assert(outDims == 32);
-
-  const __m128i kZeros[4] = { 0 };
-  __m128i out_0 = ((__m128i *)biases)[0];
-  __m128i out_1 = ((__m128i *)biases)[1];
-  __m128i out_2 = ((__m128i *)biases)[2];
-  __m128i out_3 = ((__m128i *)biases)[3];
-  __m128i out_4 = ((__m128i *)biases)[4];
-  __m128i out_5 = ((__m128i *)biases)[5];
-  __m128i out_6 = ((__m128i *)biases)[6];
-  __m128i out_7 = ((__m128i *)biases)[7];
-  const __m128i *first, *second;
-  mask2_t v;
-  unsigned idx;
-
-  memcpy(&v, inMask, sizeof(mask2_t));
-  for (unsigned offset = 0; offset < inDims;) {
-    if (!next_idx(&idx, &offset, &v, inMask, inDims))
-      break;
-    first = (__m128i *)&weights[outDims * idx];
-    uint32_t factor = input[idx];
-    if (next_idx(&idx, &offset, &v, inMask, inDims)) {
-      second = (__m128i *)&weights[outDims * idx];
-      factor |= input[idx] << 16;
-    } else {
-      second = kZeros;
-    }
-    __m128i mul = _mm_set1_epi32(factor);
-    out_0 = _mm_add_epi32(out_0, _mm_madd_epi16(mul, _mm_unpacklo_epi16(first[0],second[0])));
-    out_1 = _mm_add_epi32(out_1, _mm_madd_epi16(mul, _mm_unpackhi_epi16(first[0],second[0])));
-    out_2 = _mm_add_epi32(out_2, _mm_madd_epi16(mul, _mm_unpacklo_epi16(first[1],second[1])));
-    out_3 = _mm_add_epi32(out_3, _mm_madd_epi16(mul, _mm_unpackhi_epi16(first[1],second[1])));
-    out_4 = _mm_add_epi32(out_4, _mm_madd_epi16(mul, _mm_unpacklo_epi16(first[2],second[2])));
-    out_5 = _mm_add_epi32(out_5, _mm_madd_epi16(mul, _mm_unpackhi_epi16(first[2],second[2])));
-    out_6 = _mm_add_epi32(out_6, _mm_madd_epi16(mul, _mm_unpacklo_epi16(first[3],second[3])));
-    out_7 = _mm_add_epi32(out_7, _mm_madd_epi16(mul, _mm_unpackhi_epi16(first[3],second[3])));
-  }
-
-  __m128i out16_0 = _mm_srai_epi16(_mm_packs_epi32(out_0, out_1), SHIFT);
-  __m128i out16_1 = _mm_srai_epi16(_mm_packs_epi32(out_2, out_3), SHIFT);
-  __m128i out16_2 = _mm_srai_epi16(_mm_packs_epi32(out_4, out_5), SHIFT);
-  __m128i out16_3 = _mm_srai_epi16(_mm_packs_epi32(out_6, out_7), SHIFT);
-
-  __m128i *outVec = (__m128i *)output;
-  if (pack8_and_calc_mask) {
-    outVec[0] = _mm_packs_epi16(out16_0, out16_1);
-    outMask[0] = _mm_movemask_epi8(_mm_cmpgt_epi8(outVec[0], kZeros[0]));
-    outVec[1] = _mm_packs_epi16(out16_2, out16_3);
-    outMask[1] = _mm_movemask_epi8(_mm_cmpgt_epi8(outVec[1], kZeros[0]));
-  } else {
-    const __m128i kx07f = _mm_set1_epi16(127);
-    outVec[0] = _mm_min_epi16(_mm_max_epi16(out16_0, kZeros[0]), kx07f);
-    outVec[1] = _mm_min_epi16(_mm_max_epi16(out16_1, kZeros[0]), kx07f);
-    outVec[2] = _mm_min_epi16(_mm_max_epi16(out16_2, kZeros[0]), kx07f);
-    outVec[3] = _mm_min_epi16(_mm_max_epi16(out16_3, kZeros[0]), kx07f);
-  }
+  for (const Kernel &k : kernels)
+    if (k.halfDims == halfDims && k.supported())
+      return &k;
+  return NULL;
 }
-#elif defined(USE_MMX)
-INLINE void affine_txfm(clipped_t *input, void *output, unsigned inDims,
-    unsigned outDims, const int32_t *biases, const weight_t *weights,
-    mask_t *inMask, mask_t *outMask, const bool pack8_and_calc_mask)
-{
-  assert(outDims == 32);
-
-#if 0
-  const __m64 kZeros[2] = { 0 };
-  for (unsigned t = 0; t < 4; t++) {
-    __m64 out_0 = ((__m64 *)biases)[4 * t + 0];
-    __m64 out_1 = ((__m64 *)biases)[4 * t + 1];
-    __m64 out_2 = ((__m64 *)biases)[4 * t + 2];
-    __m64 out_3 = ((__m64 *)biases)[4 * t + 3];
-    const __m64 *first, *second;
-    mask2_t v;
-    unsigned idx;
-
-    memcpy(&v, inMask, sizeof(mask2_t));
-    for (unsigned offset = 0; offset < inDims;) {
-      if (!next_idx(&idx, &offset, &v, inMask, inDims))
-        break;
-      first = &((__m64 *)&weights[outDims * idx])[2  * t];
-      uint32_t factor = input[idx];
-      if (next_idx(&idx, &offset, &v, inMask, inDims)) {
-        second = &((__m64 *)&weights[outDims * idx])[2 * t];
-        factor |= input[idx] << 16;
-      } else {
-        second = kZeros;
-      }
-      __m64 mul = _mm_set1_pi32(factor);
-      out_0 = _mm_add_pi32(out_0, _mm_madd_pi16(mul, _mm_unpacklo_pi16(first[0],second[0])));
-      out_1 = _mm_add_pi32(out_1, _mm_madd_pi16(mul, _mm_unpackhi_pi16(first[0],second[0])));
-      out_2 = _mm_add_pi32(out_2, _mm_madd_pi16(mul, _mm_unpacklo_pi16(first[1],second[1])));
-      out_3 = _mm_add_pi32(out_3, _mm_madd_pi16(mul, _mm_unpackhi_pi16(first[1],second[1])));
-    }
 
-    __m64 out16_0 = _mm_srai_pi16(_mm_packs_pi32(out_0, out_1), SHIFT);
-    __m64 out16_1 = _mm_srai_pi16(_mm_packs_pi32(out_2, out_3), SHIFT);
-
-    __m64 *outVec = (__m64 *)output;
-    if (pack8_and_calc_mask) {
-      outVec[t] = _mm_packs_pi16(out16_0, out16_1);
-      outMask[t] = _mm_movemask_pi8(_mm_cmpgt_pi8(outVec[t], kZeros[0]));
-    } else {
-#ifdef USE_SSE
-      const __m64 kx07f = _mm_set1_pi16(127);
-      outVec[2 * t] = _mm_min_pi16(_mm_max_pi16(out16_0, kZeros[0]), kx07f);
-      outVec[2 * t + 1] = _mm_min_pi16(_mm_max_pi16(out16_1, kZeros[0]), kx07f);
-#else
-      const __m64 k0x7f80 = _mm_set1_pi16(0x7f80);
-      const __m64 k0x0080 = _mm_set1_pi16(0x0080);
-      const __m64 k0x8000 = _mm_set1_pi16(-0x8000);
-      outVec[2 * t] = _mm_subs_pu16(_mm_add_pi16(_mm_adds_pi16(out16_0, k0x7f80), k0x0080), k0x8000);
-      outVec[2 * t + 1] = _mm_subs_pu16(_mm_add_pi16(_mm_adds_pi16(out16_1, k0x7f80), k0x0080), k0x8000);
-#endif
-    }
-  }
-#else
-  const __m64 kZeros[8] = { 0 };
-  __m64 out_0 = ((__m64 *)biases)[0];
-  __m64 out_1 = ((__m64 *)biases)[1];
-  __m64 out_2 = ((__m64 *)biases)[2];
-  __m64 out_3 = ((__m64 *)biases)[3];
-  __m64 out_4 = ((__m64 *)biases)[4];
-  __m64 out_5 = ((__m64 *)biases)[5];
-  __m64 out_6 = ((__m64 *)biases)[6];
-  __m64 out_7 = ((__m64 *)biases)[7];
-  __m64 out_8 = ((__m64 *)biases)[8];
-  __m64 out_9 = ((__m64 *)biases)[9];
-  __m64 out_10 = ((__m64 *)biases)[10];
-  __m64 out_11 = ((__m64 *)biases)[11];
-  __m64 out_12 = ((__m64 *)biases)[12];
-  __m64 out_13 = ((__m64 *)biases)[13];
-  __m64 out_14 = ((__m64 *)biases)[14];
-  __m64 out_15 = ((__m64 *)biases)[15];
-  const __m64 *first, *second;
-  mask2_t v;
-  unsigned idx;
-
-  memcpy(&v, inMask, sizeof(mask2_t));
-  for (unsigned offset = 0; offset < inDims;) {
-    if (!next_idx(&idx, &offset, &v, inMask, inDims))
-      break;
-    first = (__m64 *)&weights[outDims * idx];
-    uint32_t factor = input[idx];
-    if (next_idx(&idx, &offset, &v, inMask, inDims)) {
-      second = (__m64 *)&weights[outDims * idx];
-      factor |= input[idx] << 16;
-    } else {
-      second = kZeros;
-    }
-    __m64 mul = _mm_set1_pi32(factor);
-    out_0 = _mm_add_pi32(out_0, _mm_madd_pi16(mul, _mm_unpacklo_pi16(first[0],second[0])));
-    out_1 = _mm_add_pi32(out_1, _mm_madd_pi16(mul, _mm_unpackhi_pi16(first[0],second[0])));
-    out_2 = _mm_add_pi32(out_2, _mm_madd_pi16(mul, _mm_unpacklo_pi16(first[1],second[1])));
-    out_3 = _mm_add_pi32(out_3, _mm_madd_pi16(mul, _mm_unpackhi_pi16(first[1],second[1])));
-    out_4 = _mm_add_pi32(out_4, _mm_madd_pi16(mul, _mm_unpacklo_pi16(first[2],second[2])));
-    out_5 = _mm_add_pi32(out_5, _mm_madd_pi16(mul, _mm_unpackhi_pi16(first[2],second[2])));
-    out_6 = _mm_add_pi32(out_6, _mm_madd_pi16(mul, _mm_unpacklo_pi16(first[3],second[3])));
-    out_7 = _mm_add_pi32(out_7, _mm_madd_pi16(mul, _mm_unpackhi_pi16(first[3],second[3])));
-    out_8 = _mm_add_pi32(out_8, _mm_madd_pi16(mul, _mm_unpacklo_pi16(first[4],second[4])));
-    out_9 = _mm_add_pi32(out_9, _mm_madd_pi16(mul, _mm_unpackhi_pi16(first[4],second[4])));
-    out_10 = _mm_add_pi32(out_10, _mm_madd_pi16(mul, _mm_unpacklo_pi16(first[5],second[5])));
-    out_11 = _mm_add_pi32(out_11, _mm_madd_pi16(mul, _mm_unpackhi_pi16(first[5],second[5])));
-    out_12 = _mm_add_pi32(out_12, _mm_madd_pi16(mul, _mm_unpacklo_pi16(first[6],second[6])));
-    out_13 = _mm_add_pi32(out_13, _mm_madd_pi16(mul, _mm_unpackhi_pi16(first[6],second[6])));
-    out_14 = _mm_add_pi32(out_14, _mm_madd_pi16(mul, _mm_unpacklo_pi16(first[7],second[7])));
-    out_15 = _mm_add_pi32(out_15, _mm_madd_pi16(mul, _mm_unpackhi_pi16(first[7],second[7])));
-  }
-
-  __m64 out16_0 = _mm_srai_pi16(_mm_packs_pi32(out_0, out_1), SHIFT);
-  __m64 out16_1 = _mm_srai_pi16(_mm_packs_pi32(out_2, out_3), SHIFT);
-  __m64 out16_2 = _mm_srai_pi16(_mm_packs_pi32(out_4, out_5), SHIFT);
-  __m64 out16_3 = _mm_srai_pi16(_mm_packs_pi32(out_6, out_7), SHIFT);
-  __m64 out16_4 = _mm_srai_pi16(_mm_packs_pi32(out_8, out_9), SHIFT);
-  __m64 out16_5 = _mm_srai_pi16(_mm_packs_pi32(out_10, out_11), SHIFT);
-  __m64 out16_6 = _mm_srai_pi16(_mm_packs_pi32(out_12, out_13), SHIFT);
-  __m64 out16_7 = _mm_srai_pi16(_mm_packs_pi32(out_14, out_15), SHIFT);
-
-  __m64 *outVec = (__m64 *)output;
-  if (pack8_and_calc_mask) {
-    outVec[0] = _mm_packs_pi16(out16_0, out16_1);
-    outMask[0] = _mm_movemask_pi8(_mm_cmpgt_pi8(outVec[0], kZeros[0]));
-    outVec[1] = _mm_packs_pi16(out16_2, out16_3);
-    outMask[1] = _mm_movemask_pi8(_mm_cmpgt_pi8(outVec[1], kZeros[0]));
-    outVec[2] = _mm_packs_pi16(out16_4, out16_5);
-    outMask[2] = _mm_movemask_pi8(_mm_cmpgt_pi8(outVec[2], kZeros[0]));
-    outVec[3] = _mm_packs_pi16(out16_6, out16_7);
-    outMask[3] = _mm_movemask_pi8(_mm_cmpgt_pi8(outVec[3], kZeros[0]));
-  } else {
-#ifdef USE_SSE
-    const __m64 kx07f = _mm_set1_pi16(127);
-    outVec[0] = _mm_min_pi16(_mm_max_pi16(out16_0, kZeros[0]), kx07f);
-    outVec[1] = _mm_min_pi16(_mm_max_pi16(out16_1, kZeros[0]), kx07f);
-    outVec[2] = _mm_min_pi16(_mm_max_pi16(out16_2, kZeros[0]), kx07f);
-    outVec[3] = _mm_min_pi16(_mm_max_pi16(out16_3, kZeros[0]), kx07f);
-    outVec[4] = _mm_min_pi16(_mm_max_pi16(out16_4, kZeros[0]), kx07f);
-    outVec[5] = _mm_min_pi16(_mm_max_pi16(out16_5, kZeros[0]), kx07f);
-    outVec[6] = _mm_min_pi16(_mm_max_pi16(out16_6, kZeros[0]), kx07f);
-    outVec[7] = _mm_min_pi16(_mm_max_pi16(out16_7, kZeros[0]), kx07f);
-#else
-    const __m64 k0x7f80 = _mm_set1_pi16(0x7f80);
-    const __m64 k0x0080 = _mm_set1_pi16(0x0080);
-    const __m64 k0x8000 = _mm_set1_pi16(-0x8000);
-    outVec[0] = _mm_subs_pu16(_mm_add_pi16(_mm_adds_pi16(out16_0, k0x7f80), k0x0080), k0x8000);
-    outVec[1] = _mm_subs_pu16(_mm_add_pi16(_mm_adds_pi16(out16_1, k0x7f80), k0x0080), k0x8000);
-    outVec[2] = _mm_subs_pu16(_mm_add_pi16(_mm_adds_pi16(out16_2, k0x7f80), k0x0080), k0x8000);
-    outVec[3] = _mm_subs_pu16(_mm_add_pi16(_mm_adds_pi16(out16_3, k0x7f80), k0x0080), k0x8000);
-    outVec[4] = _mm_subs_pu16(_mm_add_pi16(_mm_adds_pi16(out16_4, k0x7f80), k0x0080), k0x8000);
-    outVec[5] = _mm_subs_pu16(_mm_add_pi16(_mm_adds_pi16(out16_5, k0x7f80), k0x0080), k0x8000);
-    outVec[6] = _mm_subs_pu16(_mm_add_pi16(_mm_adds_pi16(out16_6, k0x7f80), k0x0080), k0x8000);
-    outVec[7] = _mm_subs_pu16(_mm_add_pi16(_mm_adds_pi16(out16_7, k0x7f80), k0x0080), k0x8000);
-#endif
-  }
+static void select_kernel(void)
+{
+  if (kernel) return;
+#if defined(NNUE_X86)
+  __builtin_cpu_init();
 #endif
+  kernel = find_kernel(HalfDimensions[0]);
 }
-#elif defined(USE_NEON)
-INLINE void affine_txfm(clipped_t *input, void *output, unsigned inDims,
-    unsigned outDims, const int32_t *biases, const weight_t *weights,
-    mask_t *inMask, mask_t *outMask, const bool pack8_and_calc_mask)
-{
-  assert(outDims == 32);
-
-  int32x4_t out_0 = ((int32x4_t *)biases)[0];
-  int32x4_t out_1 = ((int32x4_t *)biases)[1];
-  int32x4_t out_2 = ((int32x4_t *)biases)[2];
-  int32x4_t out_3 = ((int32x4_t *)biases)[3];
-  int32x4_t out_4 = ((int32x4_t *)biases)[4];
-  int32x4_t out_5 = ((int32x4_t *)biases)[5];
-  int32x4_t out_6 = ((int32x4_t *)biases)[6];
-  int32x4_t out_7 = ((int32x4_t *)biases)[7];
-  const int8x8_t *first;
-  mask2_t v;
-  unsigned idx;
-
-  memcpy(&v, inMask, sizeof(mask2_t));
-  for (unsigned offset = 0; offset < inDims;) {
-    if (!next_idx(&idx, &offset, &v, inMask, inDims))
-      break;
-    first = (int8x8_t *)&weights[outDims * idx];
-    int16_t factor = input[idx];
-
-    int16x8_t prod;
-    prod = vmulq_n_s16(vmovl_s8(first[0]), factor);
-    out_0 = vaddq_s32(out_0, vmovl_s16(vget_low_s16(prod)));
-    out_1 = vaddq_s32(out_1, vmovl_high_s16(prod));
-    prod = vmulq_n_s16(vmovl_s8(first[1]), factor);
-    out_2 = vaddq_s32(out_2, vmovl_s16(vget_low_s16(prod)));
-    out_3 = vaddq_s32(out_3, vmovl_high_s16(prod));
-    prod = vmulq_n_s16(vmovl_s8(first[2]), factor);
-    out_4 = vaddq_s32(out_4, vmovl_s16(vget_low_s16(prod)));
-    out_5 = vaddq_s32(out_5, vmovl_high_s16(prod));
-    prod = vmulq_n_s16(vmovl_s8(first[3]), factor);
-    out_6 = vaddq_s32(out_6, vmovl_s16(vget_low_s16(prod)));
-    out_7 = vaddq_s32(out_7, vmovl_high_s16(prod));
-  }
 
-  int16x8_t out16_0 = vcombine_s16(vqshrn_n_s32(out_0, SHIFT), vqshrn_n_s32(out_1, SHIFT));
-  int16x8_t out16_1 = vcombine_s16(vqshrn_n_s32(out_2, SHIFT), vqshrn_n_s32(out_3, SHIFT));
-  int16x8_t out16_2 = vcombine_s16(vqshrn_n_s32(out_4, SHIFT), vqshrn_n_s32(out_5, SHIFT));
-  int16x8_t out16_3 = vcombine_s16(vqshrn_n_s32(out_6, SHIFT), vqshrn_n_s32(out_7, SHIFT));
-
-  if (pack8_and_calc_mask) {
-    const int8x16_t kZero = { 0 };
-    int8x16_t *outVec = (int8x16_t *)output;
-    outVec[0] = vcombine_s8(vqmovn_s16(out16_0), vqmovn_s16(out16_1));
-    outMask[0] = neon_movemask(vcgtq_s8(outVec[0], kZero));
-    outVec[1] = vcombine_s8(vqmovn_s16(out16_2), vqmovn_s16(out16_3));
-    outMask[1] = neon_movemask(vcgtq_s8(outVec[1], kZero));
-  } else {
-    // The next step takes int8x8_t as input, so store as int8x8_t
-    const int8x8_t kZero = { 0 };
-    int8x8_t *outVec = (int8x8_t *)output;
-    outVec[0] = vmax_s8(vqmovn_s16(out16_0), kZero);
-    outVec[1] = vmax_s8(vqmovn_s16(out16_1), kZero);
-    outVec[2] = vmax_s8(vqmovn_s16(out16_2), kZero);
-    outVec[3] = vmax_s8(vqmovn_s16(out16_3), kZero);
-  }
-}
-#else /* generic fallback */
-INLINE void affine_txfm(clipped_t *input, void *output, unsigned inDims,
-    unsigned outDims, int32_t *biases, const weight_t *weights,
-    mask_t *inMask, mask_t *outMask, const bool pack8_and_calc_mask)
+int nnue_evaluate_pos(Position *pos)
 {
-  (void)inMask; (void)outMask; (void)pack8_and_calc_mask;
-
-  int32_t tmp[outDims];
+  return kernel->evaluate_pos(pos);
+}
 
-  for (unsigned i = 0; i < outDims; i++)
-    tmp[i] = biases[i];
+// Shape of a .nnue file, read from its header. The header holds a
+// description of any length, then each part of the network starts with the
+// hash of its layer types and sizes. Files may hold several layer stacks
+// back to back, one per output bucket, each with its own hash.
+typedef struct {
+  unsigned halfDims;
+  unsigned buckets;
+  size_t transformerStart;
+  size_t networkStart;
+} Shape;
 
-  for (unsigned idx = 0; idx < inDims; idx++)
-    if (input[idx])
-      for (unsigned i = 0; i < outDims; i++)
-        tmp[i] += (int8_t)input[idx] * weights[outDims * idx + i];
+#ifdef NNUE_EMBEDDED
+enum {
+  DefaultTransformerStart = 3 * 4 + 177
+};
 
-  clipped_t *outVec = (clipped_t *)output;
-  for (unsigned i = 0; i < outDims; i++)
-    outVec[i] = CLAMP(tmp[i] >> SHIFT, 0, 127);
-}
+static_assert((NNUE_EMBEDDED_PAD + DefaultTransformerStart + 4) % 64 == 0,
+    "NNUE_EMBEDDED_PAD does not align the embedded feature transformer");
 #endif
 
-// Input feature converter
-static int16_t ft_biases alignas(64) [kHalfDimensions];
-static int16_t ft_weights alignas(64) [kHalfDimensions * FtInDims];
+// The hashes are computed the way the trainer does
+static const uint32_t HalfKPHash = 0x5d69d5b8u;
 
-#ifdef VECTOR
-#define TILE_HEIGHT (NUM_REGS * SIMD_WIDTH / 16)
-#endif
+INLINE uint32_t transformer_hash(unsigned halfDims)
+{
+  return HalfKPHash ^ (2 * halfDims);
+}
 
-// Calculate cumulative value without using difference calculation
-INLINE void refresh_accumulator(Position *pos)
+INLINE uint32_t affine_hash(uint32_t prev, unsigned outDims)
 {
-  Accumulator *accumulator = &(pos->accumulator);
+  uint32_t hash = 0xcc03dae4u + outDims;
+  hash ^= prev >> 1;
+  hash ^= prev << 31;
+  return hash;
+}
 
-  IndexList activeIndices[2];
-  activeIndices[0].size = activeIndices[1].size = 0;
-  append_active_indices(pos, activeIndices);
+INLINE uint32_t clipped_relu_hash(uint32_t prev)
+{
+  return 0x538d24c7u + prev;
+}
 
-  for (unsigned c = 0; c < 2; c++) {
-#ifdef VECTOR
-    for (unsigned i = 0; i < kHalfDimensions / TILE_HEIGHT; i++) {
-      vec16_t *ft_biases_tile = (vec16_t *)&ft_biases[i * TILE_HEIGHT];
-      vec16_t *accTile = (vec16_t *)&accumulator->accumulation[c][i * TILE_HEIGHT];
-      vec16_t acc[NUM_REGS];
+static uint32_t layer_stack_hash(unsigned halfDims)
+{
+  uint32_t hash = 0xec42e90du ^ (2 * halfDims); // InputSlice
+  hash = clipped_relu_hash(affine_hash(hash, 32));
+  hash = clipped_relu_hash(affine_hash(hash, 32));
+  return affine_hash(hash, 1);
+}
 
-      for (unsigned j = 0; j < NUM_REGS; j++)
-        acc[j] = ft_biases_tile[j];
+// Size in the file of one layer stack, hash included
+INLINE size_t layer_stack_bytes(unsigned halfDims)
+{
+  return 4 + 32 * 4 + 32 * 2 * halfDims + 32 * 4 + 32 * 32 + 4 + 32;
+}
 
-      for (size_t k = 0; k < activeIndices[c].size; k++) {
-        unsigned index = activeIndices[c].values[k];
-        unsigned offset = kHalfDimensions * index + i * TILE_HEIGHT;
-        vec16_t *column = (vec16_t *)&ft_weights[offset];
+static bool verify_net(const void *evalData, size_t size, Shape *shape)
+{
+  const char *d = (const char*)evalData;
+  if (size < 16 || readu_le_u32(d) != NnueVersion) return false;
+  if (readu_le_u32(d + 8) > size - 16) return false;
+  shape->transformerStart = 12 + readu_le_u32(d + 8);
+
+  const uint32_t ftHash = readu_le_u32(d + shape->transformerStart);
+  shape->halfDims = 0;
+  for (unsigned halfDims : HalfDimensions)
+    if (ftHash == transformer_hash(halfDims))
+      shape->halfDims = halfDims;
+  if (!shape->halfDims) return false;
+
+  shape->networkStart = shape->transformerStart + 4
+      + 2 * shape->halfDims + 2 * (size_t)shape->halfDims * FtInDims;
+  const size_t stackBytes = layer_stack_bytes(shape->halfDims);
+  if (   size <= shape->networkStart
+      || (size - shape->networkStart) % stackBytes != 0)
+    return false;
+  shape->buckets = (size - shape->networkStart) / stackBytes;
+  if (shape->buckets > MaxBuckets) return false;
 
-        for (unsigned j = 0; j < NUM_REGS; j++)
-          acc[j] = vec_add_16(acc[j], column[j]);
-      }
+  const uint32_t netHash = layer_stack_hash(shape->halfDims);
+  if (readu_le_u32(d + 4) != (ftHash ^ netHash)) return false;
+  for (unsigned b = 0; b < shape->buckets; b++)
+    if (readu_le_u32(d + shape->networkStart + b * stackBytes) != netHash)
+      return false;
 
-      for (unsigned j = 0; j < NUM_REGS; j++)
-        accTile[j] = acc[j];
-    }
-#else
-    memcpy(accumulator->accumulation[c], ft_biases,
-        kHalfDimensions * sizeof(int16_t));
+  return true;
+}
 
-    for (size_t k = 0; k < activeIndices[c].size; k++) {
-      unsigned index = activeIndices[c].values[k];
-      unsigned offset = kHalfDimensions * index;
+// Parameter blocks hold the feature transformer followed by the kernel's
+// layer stacks, in the layout the kernel uses. A block built from a .nnue
+// file is saved in the user's cache directory as <hash>.<kernel>, named
+// after the content hash of the file; later processes map that file
+// read-only and use it in place, so they skip the conversion and share one
+// copy of the weights through the page cache.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t networkSize;
+  char kernel[16];
+  uint64_t sourceSize;
+  uint64_t sourceHash;
+  uint32_t halfDims;
+  uint32_t buckets;
+} ParamsHeader;
+
+// Offsets in a parameter block, all 64-byte aligned
+enum {
+  BiasesOffset = 64
+};
 
-      for (unsigned j = 0; j < kHalfDimensions; j++)
-        accumulator->accumulation[c][j] += ft_weights[offset + j];
-    }
-#endif
-  }
+static_assert(sizeof(ParamsHeader) <= BiasesOffset, "ParamsHeader too big");
 
-  accumulator->computedAccumulation = true;
+INLINE size_t weights_offset(unsigned halfDims)
+{
+  return BiasesOffset + 2 * halfDims;
 }
 
-#if 0
-// Calculate cumulative value using difference calculation if possible
-INLINE bool update_accumulator(Position *pos)
+INLINE size_t network_offset(unsigned halfDims)
 {
-  Accumulator *accumulator = &(pos->hstack[pos->hply].accumulator);
-  if (accumulator->computedAccumulation)
-    return true;
-
-  Accumulator *prevAcc;
-  if (   (pos->hply < 1 || !(prevAcc = &pos->hstack[pos->hply-1].accumulator)->computedAccumulation)
-      && (pos->hply < 2 || !(prevAcc = &pos->hstack[pos->hply-2].accumulator)->computedAccumulation) )
-    return false;
-
-  IndexList removed_indices[2], added_indices[2];
-  removed_indices[0].size = removed_indices[1].size = 0;
-  added_indices[0].size = added_indices[1].size = 0;
-  bool reset[2];
-  append_changed_indices(pos, removed_indices, added_indices, reset);
-
-#ifdef VECTOR
-  for (unsigned i = 0; i< kHalfDimensions / TILE_HEIGHT; i++) {
-    for (unsigned c = 0; c < 2; c++) {
-      vec16_t *accTile = (vec16_t *)&accumulator->accumulation[c][i * TILE_HEIGHT];
-      vec16_t acc[NUM_REGS];
-
-      if (reset[c]) {
-        vec16_t *ft_b_tile = (vec16_t *)&ft_biases[i * TILE_HEIGHT];
-        for (unsigned j = 0; j < NUM_REGS; j++)
-          acc[j] = ft_b_tile[j];
-      } else {
-        vec16_t *prevAccTile = (vec16_t *)&prevAcc->accumulation[c][i * TILE_HEIGHT];
-        for (unsigned j = 0; j < NUM_REGS; j++)
-          acc[j] = prevAccTile[j];
-
-        // Difference calculation for the deactivated features
-        for (unsigned k = 0; k < removed_indices[c].size; k++) {
-          unsigned index = removed_indices[c].values[k];
-          const unsigned offset = kHalfDimensions * index + i * TILE_HEIGHT;
-
-          vec16_t *column = (vec16_t *)&ft_weights[offset];
-          for (unsigned j = 0; j < NUM_REGS; j++)
-            acc[j] = vec_sub_16(acc[j], column[j]);
-        }
-      }
-
-      // Difference calculation for the activated features
-      for (unsigned k = 0; k < added_indices[c].size; k++) {
-        unsigned index = added_indices[c].values[k];
-        const unsigned offset = kHalfDimensions * index + i * TILE_HEIGHT;
-
-        vec16_t *column = (vec16_t *)&ft_weights[offset];
-        for (unsigned j = 0; j < NUM_REGS; j++)
-          acc[j] = vec_add_16(acc[j], column[j]);
-      }
-
-      for (unsigned j = 0; j < NUM_REGS; j++)
-        accTile[j] = acc[j];
-    }
-  }
-#else
-  for (unsigned c = 0; c < 2; c++) {
-    if (reset[c]) {
-      memcpy(accumulator->accumulation[c], ft_biases,
-          kHalfDimensions * sizeof(int16_t));
-    } else {
-      memcpy(accumulator->accumulation[c], prevAcc->accumulation[c],
-          kHalfDimensions * sizeof(int16_t));
-      // Difference calculation for the deactivated features
-      for (unsigned k = 0; k < removed_indices[c].size; k++) {
-        unsigned index = removed_indices[c].values[k];
-        const unsigned offset = kHalfDimensions * index;
-
-        for (unsigned j = 0; j < kHalfDimensions; j++)
-          accumulator->accumulation[c][j] -= ft_weights[offset + j];
-      }
-    }
-
-    // Difference calculation for the activated features
-    for (unsigned k = 0; k < added_indices[c].size; k++) {
-      unsigned index = added_indices[c].values[k];
-      const unsigned offset = kHalfDimensions * index;
-
-      for (unsigned j = 0; j < kHalfDimensions; j++)
-        accumulator->accumulation[c][j] += ft_weights[offset + j];
-    }
-  }
-#endif
-
-  accumulator->computedAccumulation = true;
-  return true;
+  return weights_offset(halfDims) + 2 * (size_t)halfDims * FtInDims;
 }
-#endif
 
-// Convert input features
-INLINE void transform(Position *pos, clipped_t *output, mask_t *outMask)
+INLINE size_t params_size(const Kernel *k, unsigned buckets)
 {
-#if 0
-  if (!update_accumulator(pos))
-#endif
-    refresh_accumulator(pos);
-
-  int16_t (*accumulation)[2][256] = &pos->accumulator.accumulation;
-  (void)outMask; // avoid compiler warning
-
-  const int perspectives[2] = { pos->player, !pos->player };
-  for (unsigned p = 0; p < 2; p++) {
-    const unsigned offset = kHalfDimensions * p;
-
-#ifdef VECTOR
-    const unsigned numChunks = (16 * kHalfDimensions) / SIMD_WIDTH;
-    vec8_t *out = (vec8_t *)&output[offset];
-    for (unsigned i = 0; i < numChunks / 2; i++) {
-      vec16_t s0 = ((vec16_t *)(*accumulation)[perspectives[p]])[i * 2];
-      vec16_t s1 = ((vec16_t *)(*accumulation)[perspectives[p]])[i * 2 + 1];
-      out[i] = vec_packs(s0, s1);
-      *outMask++ = vec_mask_pos(out[i]);
-    }
+  return network_offset(k->halfDims) + buckets * k->networkSize;
+}
 
-#else
-    for (unsigned i = 0; i < kHalfDimensions; i++) {
-      int16_t sum = (*accumulation)[perspectives[p]][i];
-      output[offset + i] = CLAMP(sum, 0, 127);
-    }
+static const char ParamsMagic[8] = "NNUEPRM";
+static const uint32_t ParamsVersion = 3;
 
-#endif
+// A private allocation, on huge pages when the system has them
+typedef struct {
+  void *mem;
+  size_t size;
+  PageKind pages;
+} Block;
 
-  }
-}
+static const Block NoBlock = { NULL, 0, PAGES_SMALL };
 
-struct NetData {
-  alignas(64) clipped_t input[FtOutDims];
-  clipped_t hidden1_out[32];
-#if (defined(USE_SSE2) || defined(USE_MMX)) && !defined(USE_AVX2)
-  int16_t hidden2_out[32];
-#else
-  int8_t hidden2_out[32];
-#endif
-};
+// What backs the weights in use: a private allocation, a mapped parameter
+// file, or the network embedded in the binary
+static Block ownedBlock = NoBlock;
+static const void *mappedBlock = NULL;
+static map_t blockMapping;
 
-// Evaluation function
-int nnue_evaluate_pos(Position *pos)
+static Block alloc_block(size_t size)
 {
-  int32_t out_value;
-  alignas(8) mask_t input_mask[FtOutDims / (8 * sizeof(mask_t))];
-  alignas(8) mask_t hidden1_mask[8 / sizeof(mask_t)] = { 0 };
-#ifdef ALIGNMENT_HACK // work around a bug in old gcc on Windows
-  uint8_t buf[sizeof(struct NetData) + 63];
-  struct NetData *b = (struct NetData *)(buf + ((((uintptr_t)buf-1) ^ 0x3f) & 0x3f));
-#define B(x) (b->x)
-#else
-  struct NetData buf;
-#define B(x) (buf.x)
-#endif
-
-  transform(pos, B(input), input_mask);
+  Block b;
+  b.size = size;
+  b.mem = alloc_large(size, &b.pages);
+  return b;
+}
 
-  affine_txfm(B(input), B(hidden1_out), FtOutDims, 32,
-      hidden1_biases, hidden1_weights, input_mask, hidden1_mask, true);
+static void free_block(Block b)
+{
+  free_large(b.mem, b.size);
+}
 
-  affine_txfm(B(hidden1_out), B(hidden2_out), 32, 32,
-      hidden2_biases, hidden2_weights, hidden1_mask, NULL, false);
+// Description of the network in use, for nnue_network_name, and of the
+// memory its transformer is read from, for nnue_memory_name
+static char networkName[64];
+static const char *memoryName = "";
 
-  out_value = affine_propagate((int8_t *)B(hidden2_out), output_biases,
-      output_weights);
+static void use_weights(const Kernel *k, unsigned buckets,
+    const int16_t *biases, const int16_t *weights, const void *network,
+    Block owned, const void *mapped, map_t mapping)
+{
+  free_block(ownedBlock);
+  if (mappedBlock)
+    unmap_file(mappedBlock, blockMapping);
 
-#if defined(USE_MMX)
-  _mm_empty();
-#endif
+  ownedBlock = owned;
+  mappedBlock = mapped;
+  blockMapping = mapping;
+  kernel = k;
+  ft_biases = biases;
+  ft_weights = weights;
+  kernel->use_network(network, buckets);
 
-  return out_value / FV_SCALE;
+  if (buckets == 1)
+    snprintf(networkName, sizeof(networkName), "HalfKP %ux2-32-32-1",
+        k->halfDims);
+  else
+    snprintf(networkName, sizeof(networkName), "HalfKP %ux2-32-32-1 x%u",
+        k->halfDims, buckets);
+
+  const char *transformer = (const char *)biases;
+  if (mapped)
+    memoryName = "mapped file";
+  else if (   transformer >= (const char *)owned.mem
+           && transformer < (const char *)owned.mem + owned.size)
+    memoryName = page_kind_name(owned.pages);
+  else
+    memoryName = "embedded";
 }
 
-static void read_output_weights(weight_t *w, const char *d)
+// All-zero weights to play with when no network could be loaded, in the
+// layout of a parameter block with one stack. Zero pages that are only
+// read take no memory.
+alignas(64) static char zeroParams[BiasesOffset + 2 * NNUE_MAX_HALF_DIMENSIONS
+    + 2 * (size_t)NNUE_MAX_HALF_DIMENSIONS * FtInDims + MaxNetworkSize];
+
+static void use_params(const Kernel *k, const ParamsHeader *p,
+    Block owned, map_t mapping)
 {
-  for (unsigned i = 0; i < 32; i++) {
-    unsigned c = i;
-#if defined(USE_AVX512)
-    unsigned b = c & 0x18;
-    b = (b << 1) | (b >> 1);
-    c = (c & ~0x18) | (b & 0x18);
-#endif
-    w[c] = *d++;
-  }
+  const char *block = (const char *)p;
+  use_weights(k, p->buckets,
+      (const int16_t *)(block + BiasesOffset),
+      (const int16_t *)(block + weights_offset(k->halfDims)),
+      block + network_offset(k->halfDims),
+      owned, owned.mem ? NULL : p, mapping);
 }
 
-INLINE unsigned wt_idx(unsigned r, unsigned c, unsigned dims)
+static bool map_params(const char *paramsFile, uint64_t sourceSize,
+    uint64_t sourceHash)
 {
-  (void)dims;
+  FD fd = open_file(paramsFile);
+  if (fd == FD_ERR) return false;
 
-#if defined(USE_AVX512)
-  if (dims > 32) {
-    unsigned b = c & 0x38;
-    b = (b << 1) | (b >> 2);
-    c = (c & ~0x38) | (b & 0x38);
-  }
-  else if (dims == 32) {
-    unsigned b = c & 0x18;
-    b = (b << 1) | (b >> 1);
-    c = (c & ~0x18) | (b & 0x18);
+  map_t mapping;
+  const ParamsHeader *h = NULL;
+  const size_t size = file_size(fd);
+  if (size >= BiasesOffset)
+    h = (const ParamsHeader *)map_file(fd, &mapping);
+  close_file(fd);
+  if (!h) return false;
+
+  const Kernel *k = NULL;
+  if (   memcmp(h->magic, ParamsMagic, sizeof(ParamsMagic)) == 0
+      && h->version == ParamsVersion)
+    k = find_kernel(h->halfDims);
+  if (   !k
+      || h->networkSize != k->networkSize
+      || strcmp(h->kernel, k->name) != 0
+      || h->buckets == 0 || h->buckets > MaxBuckets
+      || size != params_size(k, h->buckets)
+      || h->sourceSize != sourceSize
+      || h->sourceHash != sourceHash) {
+    unmap_file(h, mapping);
+    return false;
   }
 
-#elif defined(USE_AVX2)
-  if (dims > 32) {
-    unsigned b = c & 0x18;
-    b = (b << 1) | (b >> 1);
-    c = (c & ~0x18) | (b & 0x18);
+  // Reserved huge pages are worth a private copy of the block. Transparent
+  // ones are not worth giving up the copy shared with other processes.
+  Block copy = alloc_block(size);
+  if (copy.mem && copy.pages == PAGES_HUGE) {
+    memcpy(copy.mem, h, size);
+    unmap_file(h, mapping);
+    use_params(k, (const ParamsHeader *)copy.mem, copy, 0);
+    return true;
   }
+  free_block(copy);
 
-#endif
-
-#if defined(USE_AVX512)
-  return c * 64 + r + (r & ~7);
+  use_params(k, h, NoBlock, mapping);
+  return true;
+}
 
+// Write under a temporary name first, so that other processes never map a
+// partly written block.
+static bool save_params(const char *paramsFile, const ParamsHeader *p)
+{
+#ifdef _WIN32
+  unsigned pid = GetCurrentProcessId();
 #else
-  return c * 32 + r;
-
+  unsigned pid = getpid();
 #endif
+  char tmpFile[FILENAME_MAX];
+  if (snprintf(tmpFile, sizeof(tmpFile), "%s.%u.tmp", paramsFile, pid)
+      >= (int)sizeof(tmpFile))
+    return false;
+
+  FILE *f = fopen(tmpFile, "wb");
+  if (!f) return false;
+  const size_t size = params_size(find_kernel(p->halfDims), p->buckets);
+  bool success = fwrite(p, 1, size, f) == size;
+  success = fclose(f) == 0 && success;
+  if (success)
+    success = rename(tmpFile, paramsFile) == 0;
+  if (!success)
+    remove(tmpFile);
+  return success;
 }
 
-static const char *read_hidden_weights(weight_t *w, unsigned dims,
-    const char *d)
+static void init_weights(const void *evalData, const Shape *shape,
+    const Kernel *k, ParamsHeader *p)
 {
-  for (unsigned r = 0; r < 32; r++)
-    for (unsigned c = 0; c < dims; c++)
-      w[wt_idx(r, c, dims)] = *d++;
+  const char *d = (const char *)evalData + shape->transformerStart + 4;
+  int16_t *biases = (int16_t *)((char *)p + BiasesOffset);
+  int16_t *weights = (int16_t *)((char *)p + weights_offset(k->halfDims));
+  char *network = (char *)p + network_offset(k->halfDims);
 
-  return d;
+  // Read transformer
+  for (unsigned i = 0; i < k->halfDims; i++, d += 2)
+    biases[i] = readu_le_u16(d);
+  for (size_t i = 0; i < (size_t)k->halfDims * FtInDims; i++, d += 2)
+    weights[i] = readu_le_u16(d);
+
+  // Read the layer stacks, skipping their hashes
+  d = (const char *)evalData + shape->networkStart;
+  for (unsigned b = 0; b < shape->buckets; b++) {
+    k->read_network(d + 4, network + b * k->networkSize);
+    d += layer_stack_bytes(k->halfDims);
+  }
 }
 
-#ifdef USE_AVX2
-static void permute_biases(int32_t *biases)
+// Convert a verified .nnue file into a new parameter block
+static Block build_params(const void *evalData, const Shape *shape,
+    uint64_t sourceSize, uint64_t sourceHash)
 {
-  __m128i *b = (__m128i *)biases;
-  __m128i tmp[8];
-#ifdef USE_AVX512
-  tmp[0] = b[0];
-  tmp[1] = b[2];
-  tmp[2] = b[4];
-  tmp[3] = b[6];
-  tmp[4] = b[1];
-  tmp[5] = b[3];
-  tmp[6] = b[5];
-  tmp[7] = b[7];
-#elif USE_AVX2
-  tmp[0] = b[0];
-  tmp[1] = b[4];
-  tmp[2] = b[1];
-  tmp[3] = b[5];
-  tmp[4] = b[2];
-  tmp[5] = b[6];
-  tmp[6] = b[3];
-  tmp[7] = b[7];
-#else
-#error
-#endif
-  memcpy(b, tmp, 8 * sizeof(__m128i));
-}
-#endif
+  const Kernel *k = find_kernel(shape->halfDims);
+  Block b = alloc_block(params_size(k, shape->buckets));
+  ParamsHeader *p = (ParamsHeader *)b.mem;
+  if (!p) return b;
 
-enum {
-  TransformerStart = 3 * 4 + 177,
-  NetworkStart = TransformerStart + 4 + 2 * 256 + 2 * 256 * 64 * 641
-};
+  init_weights(evalData, shape, k, p);
+  memcpy(p->magic, ParamsMagic, sizeof(ParamsMagic));
+  p->version = ParamsVersion;
+  p->networkSize = k->networkSize;
+  strncpy(p->kernel, k->name, sizeof(p->kernel) - 1);
+  p->sourceSize = sourceSize;
+  p->sourceHash = sourceHash;
+  p->halfDims = shape->halfDims;
+  p->buckets = shape->buckets;
+  return b;
+}
 
-static bool verify_net(const void *evalData, size_t size)
-{
-  if (size != 21022697) return false;
+#ifdef NNUE_EMBEDDED
+// The feature transformer of a .nnue file is little-endian int16_t, which is
+// already its native layout, so the embedded copy is used in place and only
+// the small hidden layers are converted. No file is read at all.
+static bool use_embedded(void)
+{
+  Shape shape;
+  if (!verify_net(gNetworkData, gNetworkSize, &shape)) return false;
+
+  const Kernel *k = find_kernel(shape.halfDims);
+  const int16_t *biases =
+      (const int16_t *)(gNetworkData + shape.transformerStart + 4);
+
+  // A description of another length than the default one's moves the
+  // transformer off its alignment; convert the whole file then.
+  if ((uintptr_t)biases % 64 != 0) {
+    Block b = build_params(gNetworkData, &shape, 0, 0);
+    if (!b.mem) return false;
+    use_params(k, (const ParamsHeader *)b.mem, b, 0);
+    return true;
+  }
 
-  const char *d = (const char*)evalData;
-  if (readu_le_u32(d) != NnueVersion) return false;
-  if (readu_le_u32(d + 4) != 0x3e5aa6eeU) return false;
-  if (readu_le_u32(d + 8) != 177) return false;
-  if (readu_le_u32(d + TransformerStart) != 0x5d69d7b8) return false;
-  if (readu_le_u32(d + NetworkStart) != 0x63337156) return false;
+  Block block = alloc_block(shape.buckets * k->networkSize);
+  char *network = (char *)block.mem;
+  if (!network) return false;
+  for (unsigned b = 0; b < shape.buckets; b++)
+    k->read_network((const char *)gNetworkData + shape.networkStart
+        + b * layer_stack_bytes(k->halfDims) + 4, network + b * k->networkSize);
 
+  use_weights(k, shape.buckets, biases, biases + k->halfDims, network,
+      block, NULL, 0);
   return true;
 }
+#endif
 
-static void init_weights(const void *evalData)
+// FNV-1a over 64-bit words: any change to the file changes the hash, and
+// hashing a network on every load costs a few milliseconds.
+static uint64_t content_hash(const void *data, size_t size)
 {
-  const char *d = (const char *)evalData + TransformerStart + 4;
+  const unsigned char *d = (const unsigned char *)data;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, d + i, 8);
+    hash = (hash ^ word) * 0x100000001b3ULL;
+  }
+  for (; i < size; i++)
+    hash = (hash ^ d[i]) * 0x100000001b3ULL;
+  return hash ^ size;
+}
 
-  // Read transformer
-  for (unsigned i = 0; i < kHalfDimensions; i++, d += 2)
-    ft_biases[i] = readu_le_u16(d);
-  for (unsigned i = 0; i < kHalfDimensions * FtInDims; i++, d += 2)
-    ft_weights[i] = readu_le_u16(d);
-
-  // Read network
-  d += 4;
-  for (unsigned i = 0; i < 32; i++, d += 4)
-    hidden1_biases[i] = readu_le_u32(d);
-  d = read_hidden_weights(hidden1_weights, 512, d);
-  for (unsigned i = 0; i < 32; i++, d += 4)
-    hidden2_biases[i] = readu_le_u32(d);
-  d = read_hidden_weights(hidden2_weights, 32, d);
-  for (unsigned i = 0; i < 1; i++, d += 4)
-    output_biases[i] = readu_le_u32(d);
-  read_output_weights(output_weights, d);
-
-#ifdef USE_AVX2
-  permute_biases(hidden1_biases);
-  permute_biases(hidden2_biases);
+// Directory that converted blocks are kept in: $XDG_CACHE_HOME/mop-nnue or
+// ~/.cache/mop-nnue, %LOCALAPPDATA%\mop-nnue on Windows. Created on first
+// use. Returns false when there is none, and blocks are then not saved.
+static bool cache_dir(char *dir, size_t size)
+{
+#ifdef _WIN32
+  const char *base = getenv("LOCALAPPDATA");
+  if (!base || !*base) return false;
+  if (snprintf(dir, size, "%s\\mop-nnue", base) >= (int)size) return false;
+  return CreateDirectory(dir, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+  const char *base = getenv("XDG_CACHE_HOME");
+  if (base && *base) {
+    if (snprintf(dir, size, "%s/mop-nnue", base) >= (int)size) return false;
+  } else {
+    const char *home = getenv("HOME");
+    if (!home || !*home) return false;
+    if (snprintf(dir, size, "%s/.cache", home) >= (int)size) return false;
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return false;
+    if (snprintf(dir, size, "%s/.cache/mop-nnue", home) >= (int)size)
+      return false;
+  }
+  return mkdir(dir, 0755) == 0 || errno == EEXIST;
 #endif
 }
 
 static bool load_eval_file(const char *evalFile)
 {
-  const void *evalData;
-  map_t mapping;
-  size_t size;
-
 #ifdef NNUE_EMBEDDED
-  if (strcmp(evalFile, DefaultEvalFile) == 0) {
-    evalData = gNetworkData;
-    mapping = 0;
-    size = gNetworkSize;
-  } else
+  if (strcmp(evalFile, DefaultEvalFile) == 0)
+    return use_embedded();
 #endif
-  {
-    FD fd = open_file(evalFile);
-    if (fd == FD_ERR) return false;
-    evalData = map_file(fd, &mapping);
-    size = file_size(fd);
-    close_file(fd);
+
+  FD fd = open_file(evalFile);
+  if (fd == FD_ERR) return false;
+  size_t size = file_size(fd);
+  map_t mapping;
+  const void *evalData = map_file(fd, &mapping);
+  close_file(fd);
+  if (!evalData) return false;
+
+  const uint64_t hash = content_hash(evalData, size);
+  char paramsFile[FILENAME_MAX];
+  bool cached = cache_dir(paramsFile, sizeof(paramsFile));
+  if (cached) {
+    const size_t len = strlen(paramsFile);
+    cached = snprintf(paramsFile + len, sizeof(paramsFile) - len,
+        "/%016" PRIx64 ".%s", hash, kernel->name)
+        < (int)(sizeof(paramsFile) - len);
+  }
+  if (cached && map_params(paramsFile, size, hash)) {
+    unmap_file(evalData, mapping);
+    return true;
   }
 
-  bool success = verify_net(evalData, size);
-  if (success)
-    init_weights(evalData);
-  if (mapping) unmap_file(evalData, mapping);
+  Shape shape;
+  bool success = verify_net(evalData, size, &shape);
+  if (success) {
+    Block b = build_params(evalData, &shape, size, hash);
+    const ParamsHeader *p = (const ParamsHeader *)b.mem;
+    success = p != NULL;
+    if (success) {
+      if (   cached && save_params(paramsFile, p)
+          && map_params(paramsFile, size, hash))
+        free_block(b);
+      else
+        use_params(find_kernel(p->halfDims), p, b, 0);
+    }
+  }
+  unmap_file(evalData, mapping);
   return success;
 }
 
@@ -1270,37 +762,164 @@ Interfaces
 */
 static char *loadedFile = NULL;
 
-DLLExport void _CDECL nnue_init(const char* evalFile)
+DLLExport bool _CDECL nnue_init(const char* evalFile)
 {
+  select_kernel();
+  init_index_tables();
+
   if (loadedFile && strcmp(evalFile, loadedFile) == 0)
-    return;
+    return true;
 
   if (loadedFile)
     free(loadedFile);
+  loadedFile = NULL;
 
   fflush(stdout);
   if (load_eval_file(evalFile)) {
     loadedFile = strdup(evalFile);
     fflush(stdout);
-    return;
+    return true;
+  }
+
+  // Keep the previous network, or play with all-zero weights
+  if (!ft_biases) {
+    use_weights(kernel, 1,
+        (const int16_t *)(zeroParams + BiasesOffset),
+        (const int16_t *)(zeroParams + weights_offset(kernel->halfDims)),
+        zeroParams + network_offset(kernel->halfDims), NoBlock, NULL, 0);
+    memoryName = "zero weights";
   }
 
   printf("NNUE file not found!\n");
   fflush(stdout);
+  return false;
 }
 
 DLLExport int _CDECL nnue_evaluate(int player, int* pieces, int* squares)
+{
+  NNUEdata data;
+  data.accumulator.computedAccumulation[0] = false;
+  data.accumulator.computedAccumulation[1] = false;
+  data.dirtyPiece.dirtyNum = 0;
+  return nnue_evaluate_incremental(player, pieces, squares, &data, 0, NULL);
+}
+
+DLLExport int _CDECL nnue_evaluate_incremental(int player, int* pieces,
+    int* squares, NNUEdata* stack, int ply, FinnyTable* finny)
+{
+  uint64_t pieceBB[13];
+  piece_list_to_bitboards(pieces, squares, pieceBB);
+  return nnue_evaluate_bitboards(player, pieceBB, stack, ply, finny);
+}
+
+DLLExport int _CDECL nnue_evaluate_bitboards(int player,
+    const uint64_t* pieceBB, NNUEdata* stack, int ply, FinnyTable* finny)
 {
   Position pos;
   pos.player = player;
-  pos.pieces = pieces;
-  pos.squares = squares;
+  pos.pieceBB = pieceBB;
+  pos.stack = stack;
+  pos.ply = ply;
+  pos.finny = finny;
   return nnue_evaluate_pos(&pos);
 }
 
+// Evaluate the positions [begin, end) of a batch, one block at a time.
+// Refreshes go through a refresh cache, so runs of related positions, such
+// as the ones of a game, only pay for the pieces that differ.
+static void evaluate_batch_range(int begin, int end, const int* players,
+    const uint64_t* pieceBB, int* scores)
+{
+  NNUEdata *data = new NNUEdata[BatchBlock];
+  FinnyTable *finny = new FinnyTable;
+  Position pos[BatchBlock];
+
+  nnue_clear_finny_table(finny);
+
+  for (int first = begin; first < end; first += BatchBlock) {
+    const unsigned count = end - first < BatchBlock ? end - first : BatchBlock;
+    for (unsigned i = 0; i < count; i++) {
+      const int n = first + i;
+      data[i].accumulator.computedAccumulation[0] = false;
+      data[i].accumulator.computedAccumulation[1] = false;
+      data[i].dirtyPiece.dirtyNum = 0;
+      pos[i].player = players[n];
+      pos[i].pieceBB = pieceBB + 13 * n;
+      pos[i].stack = &data[i];
+      pos[i].ply = 0;
+      pos[i].finny = finny;
+    }
+    kernel->evaluate_block(pos, count, scores + first);
+  }
+
+  delete finny;
+  delete[] data;
+}
+
+DLLExport void _CDECL nnue_evaluate_batch_bitboards(int count,
+    const int* players, const uint64_t* pieceBB, int* scores, int threads)
+{
+  // Not worth a thread for less than a few blocks
+  const int maxThreads = (count + 4 * BatchBlock - 1) / (4 * BatchBlock);
+  if (threads > maxThreads)
+    threads = maxThreads;
+
+  if (threads <= 1) {
+    evaluate_batch_range(0, count, players, pieceBB, scores);
+    return;
+  }
+
+  std::vector<std::thread> workers;
+  const int slice = (count + threads - 1) / threads;
+  for (int begin = 0; begin < count; begin += slice) {
+    const int end = begin + slice < count ? begin + slice : count;
+    workers.emplace_back(evaluate_batch_range, begin, end, players, pieceBB,
+        scores);
+  }
+  for (std::thread &worker : workers)
+    worker.join();
+}
+
+DLLExport void _CDECL nnue_evaluate_batch(int count, int* players,
+    int* pieces, int* squares, int* scores, int threads)
+{
+  std::vector<uint64_t> pieceBB(13 * (size_t)count);
+  for (int i = 0; i < count; i++)
+    piece_list_to_bitboards(pieces + 33 * i, squares + 33 * i,
+        &pieceBB[13 * (size_t)i]);
+  nnue_evaluate_batch_bitboards(count, players, pieceBB.data(), scores,
+      threads);
+}
+
+DLLExport void _CDECL nnue_clear_finny_table(FinnyTable* finny)
+{
+  for (unsigned c = 0; c < 2; c++)
+    for (unsigned sq = 0; sq < 64; sq++) {
+      FinnyEntry *entry = &finny->entry[c][sq];
+      memcpy(entry->accumulation, ft_biases,
+          kernel->halfDims * sizeof(int16_t));
+      memset(entry->pieceBB, 0, sizeof(entry->pieceBB));
+    }
+}
+
 DLLExport int _CDECL nnue_evaluate_fen(const char* fen)
 {
   int pieces[33],squares[33],player,castle,fifty,move_number;
   decode_fen((char*)fen,&player,&castle,&fifty,&move_number,pieces,squares);;
   return nnue_evaluate(player,pieces,squares);
 }
+
+DLLExport const char* _CDECL nnue_kernel_name(void)
+{
+  return kernel->name;
+}
+
+DLLExport const char* _CDECL nnue_network_name(void)
+{
+  return networkName;
+}
+
+DLLExport const char* _CDECL nnue_memory_name(void)
+{
+  return memoryName;
+}
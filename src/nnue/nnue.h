@@ -6,6 +6,11 @@
 
 #include "misc.h"
 
+/*network loaded at startup; built into the binary with NNUE_EMBEDDED*/
+#ifndef DefaultEvalFile
+#define DefaultEvalFile "nn-62ef826d1a6d.nnue"
+#endif
+
 #ifdef __cplusplus
 #   define EXTERNC extern "C"
 #else
@@ -39,45 +44,92 @@ const int pic_tab[14] = {
 #define COMBINE(c,x)     ((x) + (c) * 6) 
 
 /*nnue data*/
-#if 0
+/*widest accumulator of the supported networks*/
+#define NNUE_MAX_HALF_DIMENSIONS 256
+
 typedef struct DirtyPiece {
   int dirtyNum;
   int pc[3];
   int from[3];
   int to[3];
 } DirtyPiece;
-#endif
 
 typedef struct {
-  alignas(64) int16_t accumulation[2][256];
-  bool computedAccumulation;
+  alignas(64) int16_t accumulation[2][NNUE_MAX_HALF_DIMENSIONS];
+  bool computedAccumulation[2];
 } Accumulator;
 
-/*position*/
-typedef struct Position {
-  int player;
-  int* pieces;
-  int* squares;
+/*one entry per ply: the accumulator and the move that led there*/
+typedef struct NNUEdata {
   Accumulator accumulator;
-#if 0
   DirtyPiece dirtyPiece;
-#endif
+} NNUEdata;
+
+/*refresh cache: the last accumulator built for a perspective and king
+  square, with the piece bitboards (nnue piece codes, nnue squares) it
+  was built from*/
+typedef struct FinnyEntry {
+  alignas(64) int16_t accumulation[NNUE_MAX_HALF_DIMENSIONS];
+  uint64_t pieceBB[13];
+} FinnyEntry;
+
+typedef struct FinnyTable {
+  FinnyEntry entry[2][64];
+} FinnyTable;
+
+/*position: pieceBB[pc] holds the squares of piece code pc (index 0 is
+  unused), with bit sq set for square sq in the numbering of nnue_evaluate*/
+typedef struct Position {
+  int player;
+  const uint64_t* pieceBB;
+  NNUEdata* stack;
+  int ply;
+  FinnyTable* finny;
 } Position;
 
 int nnue_evaluate_pos(Position* pos);
 
 /**
 * Load NNUE file
+* Must be called before evaluating. With NNUE_EMBEDDED, DefaultEvalFile
+* refers to the network built into the binary and reads no file. The weights converted for this CPU are
+* cached in $XDG_CACHE_HOME/mop-nnue (~/.cache/mop-nnue, or
+* %LOCALAPPDATA%\mop-nnue on Windows) under the content hash of the file,
+* and mapped from there by later calls and processes. Without a cache
+* directory they are kept in memory only.
+* HalfKP files with 256 or 128 wide accumulators and one or more output
+* buckets are accepted; the shape is read from the file header. May be
+* called again to switch networks while no evaluation is running, after
+* which accumulators and refresh caches have to be rebuilt. Returns false,
+* keeping the previous network, when the file can't be loaded.
 */
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void nnue_init(
+bool nnue_init(
   const char * evalFile             /** Path to NNUE file */
 );
 
+/**
+* Name of the SIMD kernel picked by nnue_init for this CPU
+* ("avx2", "sse4.1", "sse2", "neon" or "generic")
+*/
+const char* nnue_kernel_name(void);
+
+/**
+* Shape of the network in use, e.g. "HalfKP 256x2-32-32-1"
+*/
+const char* nnue_network_name(void);
+
+/**
+* What the transformer weights are read from: "huge pages", "transparent
+* huge pages", "small pages", "mapped file", "embedded" or "zero weights"
+* when no network could be loaded
+*/
+const char* nnue_memory_name(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -127,4 +179,79 @@ int nnue_evaluate(
 }
 #endif
 
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+* Incremental evaluation
+* -------------------------------------------------
+* Same as nnue_evaluate, plus a stack of NNUEdata owned by the caller.
+* stack[ply] belongs to the position being evaluated and stack[1..ply]
+* hold the dirty pieces of the moves leading to it, in the piece and
+* square codes above (64 = no square). The accumulators are filled in
+* lazily: clear both computedAccumulation flags when pushing an entry.
+* Refreshes after king moves go through finny when it is not NULL.
+*/
+int nnue_evaluate_incremental(
+  int player,                       /** Side to move */
+  int* pieces,                      /** Array of pieces */
+  int* squares,                     /** Corresponding array of squares the piece stand on */
+  NNUEdata* stack,                  /** Accumulator stack, one entry per ply */
+  int ply,                          /** Index of the current position in stack */
+  FinnyTable* finny                 /** Refresh cache of the calling thread, or NULL */
+);
+
+/**
+* Incremental evaluation from bitboards
+* -------------------------------------------------
+* Same as nnue_evaluate_incremental with the position given as 13
+* bitboards, indexed by piece code (entry 0 unused), with bit sq set for
+* a piece on square sq. Features are read straight from the bitboards.
+*/
+int nnue_evaluate_bitboards(
+  int player,                       /** Side to move */
+  const uint64_t* pieceBB,          /** Bitboard of each piece code */
+  NNUEdata* stack,                  /** Accumulator stack, one entry per ply */
+  int ply,                          /** Index of the current position in stack */
+  FinnyTable* finny                 /** Refresh cache of the calling thread, or NULL */
+);
+
+/**
+* Evaluate many positions at once. Position i is players[i] with the
+* piece and square arrays at pieces + 33 * i and squares + 33 * i, in the
+* format of nnue_evaluate; its score goes to scores[i]. The positions go
+* through the network in blocks, layer by layer, and are spread over up
+* to threads threads.
+*/
+void nnue_evaluate_batch(
+  int count,                        /** Number of positions */
+  int* players,                     /** Side to move of each position */
+  int* pieces,                      /** count arrays of 33 pieces */
+  int* squares,                     /** count arrays of 33 squares */
+  int* scores,                      /** Output, one score per position */
+  int threads                       /** Threads to use, 1 for the calling thread only */
+);
+
+/**
+* nnue_evaluate_batch with position i given as the 13 bitboards at
+* pieceBB + 13 * i, in the format of nnue_evaluate_bitboards.
+*/
+void nnue_evaluate_batch_bitboards(
+  int count,                        /** Number of positions */
+  const int* players,               /** Side to move of each position */
+  const uint64_t* pieceBB,          /** count arrays of 13 bitboards */
+  int* scores,                      /** Output, one score per position */
+  int threads                       /** Threads to use, 1 for the calling thread only */
+);
+
+/**
+* Reset a refresh cache to the empty board. Required before first use
+* and after loading another network.
+*/
+void nnue_clear_finny_table(FinnyTable* finny);
+#ifdef __cplusplus
+}
+#endif
+
 #endif
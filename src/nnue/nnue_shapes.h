@@ -0,0 +1,15 @@
+// Instantiates the kernels of one instruction set for every accumulator
+// width nnue.cpp knows (see HalfDimensions there). Included inside the
+// instruction set's namespace and target region.
+
+namespace w256 {
+#define NNUE_HALF_DIMENSIONS 256
+#include "nnue_kernel.h"
+#undef NNUE_HALF_DIMENSIONS
+}
+
+namespace w128 {
+#define NNUE_HALF_DIMENSIONS 128
+#include "nnue_kernel.h"
+#undef NNUE_HALF_DIMENSIONS
+}
@@ -0,0 +1,87 @@
+#include "numa.hpp"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+const NumaTopology& NumaTopology::system() {
+  static const NumaTopology topology;
+  return topology;
+}
+
+// Nodes are listed in /sys/devices/system/node/online and their CPUs in
+// nodeN/cpulist, both in the kernel's list format, e.g. "0-7,16-23". CPUs
+// outside the affinity mask the process was started with are left out, and
+// so are nodes that keep none.
+NumaTopology::NumaTopology() {
+#ifdef __linux__
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  const bool masked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+  std::ifstream onlineFile("/sys/devices/system/node/online");
+  std::string online;
+  if (std::getline(onlineFile, online)) {
+    for (int node : parseCpuList(online)) {
+      std::ifstream cpuFile("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+      std::string cpuList;
+      if (!std::getline(cpuFile, cpuList)) {
+        continue;
+      }
+
+      std::vector<int> cpus;
+      for (int cpu : parseCpuList(cpuList)) {
+        if (cpu < CPU_SETSIZE && (!masked || CPU_ISSET(cpu, &allowed))) {
+          cpus.push_back(cpu);
+        }
+      }
+      if (!cpus.empty()) {
+        nodeCpus.push_back(std::move(cpus));
+      }
+    }
+  }
+#endif
+
+  if (nodeCpus.empty()) {
+    nodeCpus.emplace_back();
+  }
+}
+
+std::vector<int> NumaTopology::parseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::stringstream stream(list);
+  std::string range;
+
+  while (std::getline(stream, range, ',')) {
+    const size_t dash = range.find('-');
+    try {
+      const int first = std::stoi(range.substr(0, dash));
+      const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+    } catch (const std::exception&) {
+      // Not a number: skip the range
+    }
+  }
+  return cpus;
+}
+
+void NumaTopology::bindCurrentThread(int threadIndex) const {
+#ifdef __linux__
+  if (nodeCount() < 2) {
+    return;
+  }
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (int cpu : nodeCpus[nodeOf(threadIndex)]) {
+    CPU_SET(cpu, &cpus);
+  }
+  sched_setaffinity(0, sizeof(cpus), &cpus);
+#else
+  (void)threadIndex;
+#endif
+}
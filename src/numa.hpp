@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// The CPUs of each NUMA node the process may run on, read once from sysfs
+// on Linux. Elsewhere, and on machines with a single node, there is one
+// node and threads are left to the scheduler.
+class NumaTopology {
+public:
+  static const NumaTopology& system();
+
+  int nodeCount() const { return static_cast<int>(nodeCpus.size()); }
+
+  // Node of the index-th search thread: threads are spread round-robin, so
+  // every node gets its share of the threads and of the table they place.
+  int nodeOf(int threadIndex) const { return threadIndex % nodeCount(); }
+
+  // Restricts the calling thread to the CPUs of its node, so that the pages
+  // it first touches stay local to where it keeps running. Does nothing
+  // with a single node.
+  void bindCurrentThread(int threadIndex) const;
+
+private:
+  NumaTopology();
+
+  static std::vector<int> parseCpuList(const std::string& list);
+
+  std::vector<std::vector<int>> nodeCpus;
+};
@@ -1,198 +1,178 @@
 #include "search.hpp"
 #include <algorithm>
 #include <vector>
+#include "thread_pool.hpp"
+#include "sync_io.hpp"
 
 namespace {
-  constexpr int PIECE_VALUES[6] = {100, 200, 300, 400, 500, 600};
-  constexpr int ATTACKER_PENALTIES[6] = {5, 4, 3, 2, 1, 0};
-  constexpr int NO_HASH_ENTRY = 100000;
-  
-  int calculateMvvLvaScore(int victimPiece, int attackerPiece) {
-    const int victimType = victimPiece % 6;
-    const int attackerType = attackerPiece % 6;
-    return PIECE_VALUES[victimType] + ATTACKER_PENALTIES[attackerType];
-  }
-  
   std::string squareToString(uint32_t square) {
     constexpr const char FILES[] = "abcdefgh";
     const uint32_t file = square % 8;
     const uint32_t rank = 8 - (square / 8);
     return std::string(1, FILES[file]) + std::to_string(rank);
   }
+}
+
+std::string ChessSearch::moveToString(const Move& move) {
+  std::string result = squareToString(move.get_from_sq()) + squareToString(move.get_to_sq());
   
-  std::string moveToString(const Move& move) {
-    std::string result = squareToString(move.get_from_sq()) + squareToString(move.get_to_sq());
-    
-    if (move.is_promo()) {
-      switch (move.get_prom_piece()) {
-        case PieceType::queen: result += "q"; break;
-        case PieceType::rook: result += "r"; break;
-        case PieceType::bishop: result += "b"; break;
-        case PieceType::knight: result += "n"; break;
-        default: break;
-      }
+  if (move.is_promo()) {
+    switch (move.get_prom_piece()) {
+      case PieceType::queen: result += "q"; break;
+      case PieceType::rook: result += "r"; break;
+      case PieceType::bishop: result += "b"; break;
+      case PieceType::knight: result += "n"; break;
+      default: break;
     }
-    
-    return result;
   }
+  
+  return result;
 }
 
-ChessSearch::ChessSearch(int hashSizeMB) 
-  : transpositionTable(hashSizeMB),
+ChessSearch::ChessSearch(ThreadPool& pool, int threadIndex) 
+  : threadPool(pool),
+    transpositionTable(pool.getTranspositionTable()),
+    threadIndex(threadIndex),
     currentPly(0),
-    searchStartTime(0),
     nodesSearched(0),
-    searchStopped(false),
-    timeAllocated(INT64_MAX),
+    bestScore(0),
+    completedDepth(0),
     repetitionIndex(0),
-    scorePrincipalVariation(false),
+    pvIndex(0),
     followPrincipalVariation(false) {
   resetRepetitionTable();
 }
 
-void ChessSearch::setTimeLimit(uint64_t timeLimit) {
-  timeAllocated = timeLimit;
-}
-
-void ChessSearch::stopSearch() {
-  searchStopped = true;
-}
-
 void ChessSearch::resetRepetitionTable() {
   std::fill(repetitionTable.begin(), repetitionTable.end(), 0);
   repetitionIndex = 0;
 }
 
-void ChessSearch::enablePrincipalVariationScoring(const MoveArray& moves) {
-  followPrincipalVariation = false;
-  
-  for (size_t i = 0; i < moves.size(); ++i) {
-    if (principalVariationTable[0][currentPly] == moves.get(i)) {
-      scorePrincipalVariation = true;
-      followPrincipalVariation = true;
-      break;
-    }
+// While the current line still follows the previous iteration's PV, its move
+// at this ply is tried first. Stops following as soon as it does not apply.
+Move ChessSearch::principalVariationMove(const Board& board) {
+  if (!followPrincipalVariation) {
+    return Move{};
   }
-}
 
-int ChessSearch::calculateMoveScore(Move move, const Board& board) const {
-  if (scorePrincipalVariation && principalVariationTable[0][currentPly] == move) {
-    return 20000;
-  }
+  const Move move = principalVariationTable[0][currentPly];
+  followPrincipalVariation = move.get_body() && is_pseudo_legal(board, move);
+  return followPrincipalVariation ? move : Move{};
+}
 
-  if (!move.is_capture()) {
-    if (killerMoves[0][currentPly] == move) {
-      return 9000;
-    }
-    if (killerMoves[1][currentPly] == move) {
-      return 8000;
+bool ChessSearch::isPositionRepeated(uint64_t hashKey) const {
+  for (int i = 0; i < repetitionIndex; ++i) {
+    if (repetitionTable[i] == hashKey) {
+      return true;
     }
-    return historyMoves[static_cast<int>(move.get_piece())][move.get_to_sq()];
   }
+  return false;
+}
 
-  int targetPieceIndex = 0;
-  const int startIndex = static_cast<int>(opposite_side(board.get_side())) * 6;
-  const int endIndex = startIndex + 5;
+bool ChessSearch::isSearchStopped() const {
+  return threadPool.isStopRequested();
+}
 
-  for (int i = startIndex; i <= endIndex; ++i) {
-    if (board.get_piece_bitboard_by_idx(i).get_bit(move.get_to_sq())) {
-      targetPieceIndex = i;
-      break;
-    }
+// Only the main thread watches the clock; helpers just follow the shared stop flag.
+void ChessSearch::checkTime() {
+  if (isMainThread() && (getNodesSearched() & 2047) == 0 && threadPool.isTimeExpired()) {
+    threadPool.stopSearch();
   }
+}
 
-  return calculateMvvLvaScore(static_cast<int>(move.get_piece()), targetPieceIndex) + 10000;
+// Relaxed load + store instead of fetch_add: the counter has a single writer,
+// other threads only read it for reporting.
+void ChessSearch::countNode() {
+  nodesSearched.store(nodesSearched.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
 }
 
-void ChessSearch::sortMoves(MoveArray& moves, const Board& board) const {
-  std::vector<int> moveScores(moves.size());
-  
-  for (size_t i = 0; i < moves.size(); ++i) {
-    moveScores[i] = calculateMoveScore(moves.get(i), board);
-  }
+// The state record of ply p holds what the move played at ply p overwrote.
+// The child's cluster is requested first and loads while the move is played.
+void ChessSearch::makeMove(Board& board, Move move) {
+  transpositionTable.prefetch(board.key_after(move));
+  ++repetitionIndex;
+  repetitionTable[repetitionIndex] = board.get_hash_key();
+  board.make_move(move, stateStack[currentPly]);
+  accumulators.push(stateStack[currentPly].dirty);
+  ++currentPly;
+}
 
-  for (size_t i = 0; i < moves.size(); ++i) {
-    for (size_t j = i + 1; j < moves.size(); ++j) {
-      if (moveScores[i] < moveScores[j]) {
-        moves.swap(i, j);
-        std::swap(moveScores[i], moveScores[j]);
-      }
-    }
-  }
+void ChessSearch::unmakeMove(Board& board, Move move) {
+  --currentPly;
+  --repetitionIndex;
+  accumulators.pop();
+  board.unmake_move(move, stateStack[currentPly]);
 }
 
-bool ChessSearch::isPositionRepeated(uint64_t hashKey) const {
-  for (int i = 0; i < repetitionIndex; ++i) {
-    if (repetitionTable[i] == hashKey) {
-      return true;
-    }
-  }
-  return false;
+void ChessSearch::makeNullMove(Board& board) {
+  ++repetitionIndex;
+  repetitionTable[repetitionIndex] = board.get_hash_key();
+  board.make_null_move(stateStack[currentPly]);
+  accumulators.push(stateStack[currentPly].dirty);
+  ++currentPly;
 }
 
-bool ChessSearch::isTimeExpired() const {
-  return ((nodesSearched & 2047) == 0) && 
-         ((getCurrentTimeMilliseconds() - searchStartTime) > timeAllocated);
+void ChessSearch::unmakeNullMove(Board& board) {
+  --currentPly;
+  --repetitionIndex;
+  accumulators.pop();
+  board.unmake_null_move(stateStack[currentPly]);
 }
 
 int ChessSearch::quiescenceSearch(int alpha, int beta, Board& board) {
-  if (isTimeExpired()) {
-    searchStopped = true;
-  }
+  checkTime();
+  countNode();
 
-  ++nodesSearched;
+  const uint64_t hashKey = board.get_hash_key();
+  TranspositionData hashEntry{};
+  const bool hashHit = transpositionTable.probe(hashKey, currentPly, hashEntry);
 
-  const int standPatScore = evaluate(board);
+  // An entry of this position already knows its static eval.
+  const int standPatScore = hashHit && hashEntry.eval != TranspositionTable::NO_EVAL
+    ? hashEntry.eval
+    : accumulators.evaluate(board);
 
   if (currentPly > MAX_PLY - 1) {
     return standPatScore;
   }
 
   if (standPatScore >= beta) {
+    transpositionTable.store(beta, 0, HashFlag::BETA, hashKey, currentPly, 0, standPatScore);
     return beta;
   }
 
+  HashFlag hashFlag = HashFlag::ALPHA;
+  Move bestMove;
+
   if (standPatScore > alpha) {
     alpha = standPatScore;
   }
 
-  MoveArray moves{};
-  fill_move_array(moves, board);
-  sortMoves(moves, board);
-
-  for (size_t i = 0; i < moves.size(); ++i) {
-    if (!moves.get(i).is_capture()) {
-      continue;
-    }
-
-    const Board boardCopy = board;
-    ++currentPly;
-    ++repetitionIndex;
-    repetitionTable[repetitionIndex] = board.get_hash_key();
-
-    if (!board.make_move(moves.get(i))) {
-      --currentPly;
-      --repetitionIndex;
-      continue;
-    }
+  MovePicker movePicker(board, hashHit ? move_from_compact(board, hashEntry.move) : Move{});
+  Move move;
 
+  while ((move = movePicker.nextMove()).get_body()) {
+    makeMove(board, move);
     const int score = -quiescenceSearch(-beta, -alpha, board);
-    --currentPly;
-    --repetitionIndex;
-    board = boardCopy;
+    unmakeMove(board, move);
 
-    if (searchStopped) {
+    if (isSearchStopped()) {
       return 0;
     }
 
     if (score > alpha) {
+      hashFlag = HashFlag::EXACT;
+      bestMove = move;
       alpha = score;
       if (score >= beta) {
+        transpositionTable.store(beta, 0, HashFlag::BETA, hashKey, currentPly,
+                                 move.to_compact(), standPatScore);
         return beta;
       }
     }
   }
 
+  transpositionTable.store(alpha, 0, hashFlag, hashKey, currentPly, bestMove.to_compact(), standPatScore);
   return alpha;
 }
 
@@ -207,32 +187,34 @@ int ChessSearch::negamaxSearch(int alpha, int beta, int depth, Board& board) {
   }
 
   const bool isPrincipalVariationNode = (beta - alpha) > 1;
+  TranspositionData hashEntry{};
+  const bool hashHit = transpositionTable.probe(board.get_hash_key(), currentPly, hashEntry);
 
-  if (!isPrincipalVariationNode && currentPly != 0) {
-    score = transpositionTable.probe(alpha, beta, depth, board.get_hash_key(), currentPly);
-    if (score != NO_HASH_ENTRY) {
-      return score;
+  if (hashHit && !isPrincipalVariationNode && currentPly != 0 && hashEntry.depth >= depth) {
+    if (hashEntry.flag == HashFlag::EXACT) {
+      return hashEntry.score;
+    }
+    if (hashEntry.flag == HashFlag::ALPHA && hashEntry.score <= alpha) {
+      return alpha;
+    }
+    if (hashEntry.flag == HashFlag::BETA && hashEntry.score >= beta) {
+      return beta;
     }
   }
 
-  if (isTimeExpired()) {
-    searchStopped = true;
-  }
+  checkTime();
 
   if (depth == 0) {
     return quiescenceSearch(alpha, beta, board);
   }
   
   if (currentPly > MAX_PLY - 1) {
-    return evaluate(board);
+    return accumulators.evaluate(board);
   }
 
-  ++nodesSearched;
+  countNode();
 
-  const bool inCheck = board.is_sq_attacked(
-    board.get_piece_bitboard_by_idx(5 + 6 * static_cast<int>(board.get_side())).get_lsb_index(), 
-    opposite_side(board.get_side())
-  );
+  const bool inCheck = board.in_check();
 
   if (inCheck) {
     ++depth;
@@ -241,23 +223,11 @@ int ChessSearch::negamaxSearch(int alpha, int beta, int depth, Board& board) {
   int legalMovesCount = 0;
 
   if (depth >= 3 && !inCheck && currentPly != 0) {
-    const Board boardCopy = board;
-
-    ++currentPly;
-    ++repetitionIndex;
-    repetitionTable[repetitionIndex] = board.get_hash_key();
-
-    if (board.get_enpassant().first) {
-      board.change_hash_en();
-    }
-
-    board.switch_side();
+    makeNullMove(board);
     score = -negamaxSearch(-beta, -beta + 1, depth - 3, board);
-    --currentPly;
-    --repetitionIndex;
-    board = boardCopy;
+    unmakeNullMove(board);
 
-    if (searchStopped) {
+    if (isSearchStopped()) {
       return 0;
     }
 
@@ -266,36 +236,32 @@ int ChessSearch::negamaxSearch(int alpha, int beta, int depth, Board& board) {
     }
   }
 
-  MoveArray moves{};
-  fill_move_array(moves, board);
-
-  if (followPrincipalVariation) {
-    enablePrincipalVariationScoring(moves);
+  // The PV move goes first while the line is followed, otherwise the best
+  // move an earlier search left in the table.
+  Move hashMove = principalVariationMove(board);
+  if (!hashMove.get_body() && hashHit) {
+    hashMove = move_from_compact(board, hashEntry.move);
   }
 
-  sortMoves(moves, board);
-
+  MovePicker movePicker(board, hashMove,
+                        killerMoves[0][currentPly], killerMoves[1][currentPly], historyMoves);
+  Move move;
+  Move bestMove;
   int movesSearched = 0;
 
-  for (size_t i = 0; i < moves.size(); ++i) {
-    const Board boardCopy = board;
-    ++currentPly;
-    ++repetitionIndex;
-    repetitionTable[repetitionIndex] = board.get_hash_key();
-
-    if (!board.make_move(moves.get(i))) {
-      --currentPly;
-      --repetitionIndex;
+  while ((move = movePicker.nextMove()).get_body()) {
+    if (currentPly == 0 && !isRootMoveSearchable(move)) {
       continue;
     }
 
+    makeMove(board, move);
     ++legalMovesCount;
 
     if (movesSearched == 0) {
       score = -negamaxSearch(-beta, -alpha, depth - 1, board);
     } else {
       if (movesSearched >= FULL_DEPTH_MOVES && depth >= REDUCTION_LIMIT && 
-          !inCheck && !moves.get(i).is_capture() && !moves.get(i).is_promo()) {
+          !inCheck && !move.is_capture() && !move.is_promo()) {
         score = -negamaxSearch(-alpha - 1, -alpha, depth - 2, board);
       } else {
         score = alpha + 1;
@@ -309,26 +275,29 @@ int ChessSearch::negamaxSearch(int alpha, int beta, int depth, Board& board) {
       } 
     }
     
-    --currentPly;
-    --repetitionIndex;
-    board = boardCopy;
+    unmakeMove(board, move);
     
-    if (searchStopped) {
+    if (isSearchStopped()) {
       return 0;
     }
 
+    if (currentPly == 0) {
+      updateRootMove(move, score, depth, movesSearched == 0 || score > alpha);
+    }
+
     ++movesSearched;
 
     if (score > alpha) {
       hashFlag = HashFlag::EXACT;
+      bestMove = move;
 
-      if (!moves.get(i).is_capture()) {
-        historyMoves[static_cast<int>(moves.get(i).get_piece())][moves.get(i).get_to_sq()] += depth;
+      if (!move.is_capture()) {
+        historyMoves[static_cast<int>(move.get_piece())][move.get_to_sq()] += depth;
       }
 
       alpha = score;
 
-      principalVariationTable[currentPly][currentPly] = moves.get(i);
+      principalVariationTable[currentPly][currentPly] = move;
 
       for (int nextPly = currentPly + 1; nextPly < principalVariationLengths[currentPly + 1]; ++nextPly) {
         principalVariationTable[currentPly][nextPly] = principalVariationTable[currentPly + 1][nextPly];
@@ -337,11 +306,12 @@ int ChessSearch::negamaxSearch(int alpha, int beta, int depth, Board& board) {
       principalVariationLengths[currentPly] = principalVariationLengths[currentPly + 1];
 
       if (score >= beta) {
-        transpositionTable.store(beta, depth, HashFlag::BETA, board.get_hash_key(), currentPly);
+        transpositionTable.store(beta, depth, HashFlag::BETA, board.get_hash_key(), currentPly,
+                                 move.to_compact());
 
-        if (!moves.get(i).is_capture()) {
+        if (!move.is_capture()) {
           killerMoves[1][currentPly] = killerMoves[0][currentPly];
-          killerMoves[0][currentPly] = moves.get(i);
+          killerMoves[0][currentPly] = move;
         }
 
         return beta;
@@ -357,19 +327,122 @@ int ChessSearch::negamaxSearch(int alpha, int beta, int depth, Board& board) {
     }
   }
 
-  transpositionTable.store(alpha, depth, hashFlag, board.get_hash_key(), currentPly);
+  transpositionTable.store(alpha, depth, hashFlag, board.get_hash_key(), currentPly, bestMove.to_compact());
   return alpha;
 }
 
-void ChessSearch::findBestMove(Board& board, int maxDepth) {
-  searchStartTime = getCurrentTimeMilliseconds();
-  std::string bestMoveString = "none";
+void ChessSearch::printSearchInfo(int depth, int multiPV) const {
+  const uint64_t nodes = threadPool.getNodesSearched();
+  std::lock_guard<std::mutex> lock(outputMutex());
 
-  int score = 0;
-  nodesSearched = 0;
-  searchStopped = false;
+  for (int lineIndex = 0; lineIndex < multiPV; ++lineIndex) {
+    const RootMove& line = rootMoves[lineIndex];
+    printLine(multiPV > 1 ? lineIndex + 1 : 0, line.score, depth, nodes, line.pv);
+  }
+}
+
+void ChessSearch::printBestLine() const {
+  const uint64_t nodes = threadPool.getNodesSearched();
+  std::lock_guard<std::mutex> lock(outputMutex());
+  printLine(0, bestScore, completedDepth, nodes, bestLine);
+}
+
+// lineNumber is the MultiPV index, or 0 when only one line is searched.
+// The caller holds the output lock.
+void ChessSearch::printLine(int lineNumber, int score, int depth, uint64_t nodes, const std::vector<Move>& pv) const {
+  std::cout << "info";
+  if (lineNumber) {
+    std::cout << " multipv " << lineNumber;
+  }
+
+  if (score > -MATE_VALUE && score < -MATE_SCORE) {
+    std::cout << " score mate " << -(score + MATE_VALUE) / 2 - 1 
+              << " depth " << depth << " nodes " << nodes;
+  } else if (score > MATE_SCORE && score < MATE_VALUE) {
+    std::cout << " score mate " << (MATE_VALUE - score) / 2 + 1 
+              << " depth " << depth << " nodes " << nodes;
+  } else {
+    std::cout << " score cp " << score 
+              << " depth " << depth << " nodes " << nodes;
+  }
+
+  std::cout << " pv ";
+  for (const Move& move : pv) {
+    std::cout << moveToString(move) << " ";
+  }
+  std::cout << std::endl;
+}
+
+void ChessSearch::initRootMoves(const Board& board) {
+  rootMoves.clear();
+
+  MoveArray moves{};
+  fill_move_array(moves, board);
+
+  for (size_t i = 0; i < moves.size(); ++i) {
+    rootMoves.emplace_back(moves.get(i), -INFINITY_VALUE);
+  }
+}
+
+bool ChessSearch::isRootMoveSearchable(Move move) const {
+  for (size_t i = pvIndex; i < rootMoves.size(); ++i) {
+    if (rootMoves[i].move == move) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Called at the root after each move has been searched. Moves that did not
+// raise alpha get -infinity so that the stable sort keeps them behind the
+// moves with exact scores.
+void ChessSearch::updateRootMove(Move move, int score, int depth, bool isBest) {
+  for (size_t i = pvIndex; i < rootMoves.size(); ++i) {
+    RootMove& rootMove = rootMoves[i];
+    if (rootMove.move != move) {
+      continue;
+    }
+
+    if (!isBest) {
+      rootMove.score = -INFINITY_VALUE;
+      return;
+    }
+
+    rootMove.score = score;
+    rootMove.depth = depth;
+    rootMove.pv.assign(1, move);
+    for (int nextPly = 1; nextPly < principalVariationLengths[1]; ++nextPly) {
+      rootMove.pv.push_back(principalVariationTable[1][nextPly]);
+    }
+    return;
+  }
+}
+
+// Seeds the triangular PV table with the line of the root move about to be
+// searched, so PV-following ordering works for every MultiPV line.
+void ChessSearch::loadPrincipalVariation(const RootMove& rootMove) {
+  const int length = std::min(static_cast<int>(rootMove.pv.size()), MAX_PLY);
+  for (int i = 0; i < length; ++i) {
+    principalVariationTable[0][i] = rootMove.pv[i];
+  }
+  principalVariationLengths[0] = length;
+}
+
+void ChessSearch::iterativeDeepening(Board& board, int maxDepth) {
+  // Helpers skip a thread-dependent subset of depths so that the threads
+  // spread over different iterations instead of duplicating the main one.
+  static constexpr int SKIP_SIZE[]  = { 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4 };
+  static constexpr int SKIP_PHASE[] = { 0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7 };
+  static constexpr int ASPIRATION_WINDOW = 50;
+
+  currentPly = 0;
+  accumulators.reset();
+  bestMove = Move{};
+  ponderMove = Move{};
+  bestScore = 0;
+  completedDepth = 0;
+  bestLine.clear();
   followPrincipalVariation = false;
-  scorePrincipalVariation = false;
 
   for (auto& killerArray : killerMoves) {
     std::fill(killerArray.begin(), killerArray.end(), Move{});
@@ -382,48 +455,91 @@ void ChessSearch::findBestMove(Board& board, int maxDepth) {
   }
   std::fill(principalVariationLengths.begin(), principalVariationLengths.end(), 0);
 
-  int alpha = -INFINITY_VALUE;
-  int beta = +INFINITY_VALUE;
+  initRootMoves(board);
+  if (rootMoves.empty()) {
+    return;
+  }
+
+  // A stop can arrive before depth 1 completes, and bestmove must still be
+  // a legal move then.
+  bestMove = rootMoves.front().move;
+  bestLine.assign(1, bestMove);
+
+  // Helpers only ever look for the single best line.
+  const int multiPV = isMainThread()
+    ? std::min(threadPool.getMultiPV(), static_cast<int>(rootMoves.size()))
+    : 1;
 
   for (int depth = 1; depth <= maxDepth; ++depth) {
-    if (searchStopped) {
+    if (isSearchStopped()) {
       break;
     }
 
-    followPrincipalVariation = true;
-    score = negamaxSearch(alpha, beta, depth, board);
-    
-    if (score <= alpha || score >= beta) {
-      alpha = -INFINITY_VALUE;
-      beta = +INFINITY_VALUE;
-      continue;
+    if (!isMainThread()) {
+      const int skipIndex = (threadIndex - 1) % 20;
+      if (((depth + SKIP_PHASE[skipIndex]) / SKIP_SIZE[skipIndex]) % 2) {
+        continue;
+      }
     }
 
-    alpha = score - 50;
-    beta = score + 50;
+    for (RootMove& rootMove : rootMoves) {
+      rootMove.previousScore = rootMove.score;
+    }
 
-    if (principalVariationLengths[0] > 0) {
-      const Move firstMove = principalVariationTable[0][0];
-      bestMoveString = moveToString(firstMove);
+    // One pass per line: pass i only searches the root moves that were not
+    // already chosen as one of the first i lines.
+    for (pvIndex = 0; pvIndex < static_cast<size_t>(multiPV); ++pvIndex) {
+      const int previousScore = rootMoves[pvIndex].previousScore;
+      int alpha = -INFINITY_VALUE;
+      int beta = +INFINITY_VALUE;
 
-      if (score > -MATE_VALUE && score < -MATE_SCORE) {
-        std::cout << "info score mate " << -(score + MATE_VALUE) / 2 - 1 
-                  << " depth " << depth << " nodes " << nodesSearched;
-      } else if (score > MATE_SCORE && score < MATE_VALUE) {
-        std::cout << "info score mate " << (MATE_VALUE - score) / 2 + 1 
-                  << " depth " << depth << " nodes " << nodesSearched;
-      } else {
-        std::cout << "info score cp " << score 
-                  << " depth " << depth << " nodes " << nodesSearched;
+      if (depth > 1 && previousScore != -INFINITY_VALUE) {
+        alpha = previousScore - ASPIRATION_WINDOW;
+        beta = previousScore + ASPIRATION_WINDOW;
       }
 
-      std::cout << " pv ";
-      for (int i = 0; i < principalVariationLengths[0]; ++i) {
-        std::cout << moveToString(principalVariationTable[0][i]) << " ";
+      loadPrincipalVariation(rootMoves[pvIndex]);
+
+      while (true) {
+        followPrincipalVariation = true;
+        const int score = negamaxSearch(alpha, beta, depth, board);
+
+        if (isSearchStopped() || (score > alpha && score < beta)) {
+          break;
+        }
+
+        if (alpha == -INFINITY_VALUE && beta == +INFINITY_VALUE) {
+          break;
+        }
+
+        alpha = -INFINITY_VALUE;
+        beta = +INFINITY_VALUE;
       }
-      std::cout << "\n";
+
+      const auto byScore = [](const RootMove& a, const RootMove& b) { return a.score > b.score; };
+      std::stable_sort(rootMoves.begin() + pvIndex, rootMoves.end(), byScore);
+
+      if (isSearchStopped()) {
+        break;
+      }
+
+      // A later line may have come out above an earlier one.
+      std::stable_sort(rootMoves.begin(), rootMoves.begin() + pvIndex + 1, byScore);
+    }
+
+    if (isSearchStopped()) {
+      break;
     }
-  }
 
-  std::cout << "bestmove " << bestMoveString << std::endl;
-}
\ No newline at end of file
+    const RootMove& best = rootMoves.front();
+    bestMove = best.move;
+    ponderMove = best.pv.size() > 1 ? best.pv[1] : Move{};
+    bestScore = best.score;
+    completedDepth = depth;
+    bestLine = best.pv;
+
+    if (isMainThread()) {
+      printSearchInfo(depth, multiPV);
+    }
+  }
+}
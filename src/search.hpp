@@ -2,54 +2,103 @@
 
 #include <iostream>
 #include <array>
+#include <atomic>
+#include <vector>
 #include "board.hpp"
 #include "transposition_table.hpp"
 #include "evaluation.hpp"
 #include "move_array.hpp"
 #include "move_generator.hpp"
+#include "move_picker.hpp"
 #include "time.hpp"
 
+class ThreadPool;
+
 class ChessSearch {
 public:
-  explicit ChessSearch(int hashSizeMB = 64);
-  
-  void setTimeLimit(uint64_t timeLimit);
-  void stopSearch();
+  static constexpr int MATE_SCORE = 48000;
+  static constexpr int MATE_VALUE = 49000;
+
+  ChessSearch(ThreadPool& pool, int threadIndex);
+
+  static std::string moveToString(const Move& move);
+
   void resetRepetitionTable();
-  void findBestMove(Board& board, int maxDepth);
+  void iterativeDeepening(Board& board, int maxDepth);
+
+  uint64_t getNodesSearched() const { return nodesSearched.load(std::memory_order_relaxed); }
+  void resetNodesSearched() { nodesSearched.store(0, std::memory_order_relaxed); }
+  Move getBestMove() const { return bestMove; }
+  Move getPonderMove() const { return ponderMove; }
+  int getBestScore() const { return bestScore; }
+  int getCompletedDepth() const { return completedDepth; }
+  bool isMainThread() const { return threadIndex == 0; }
+
+  // Reports the line behind getBestMove(), for when the thread vote plays
+  // this thread's move rather than the one the main thread printed.
+  void printBestLine() const;
 
 private:
-  static constexpr int MATE_SCORE = 48000;
-  static constexpr int MATE_VALUE = 49000;
   static constexpr int INFINITY_VALUE = 500000;
   static constexpr int MAX_PLY = 64;
   static constexpr int FULL_DEPTH_MOVES = 4;
   static constexpr int REDUCTION_LIMIT = 3;
-  
-  TranspositionTable transpositionTable;
-  
+
+  struct RootMove {
+    RootMove(Move rootMove, int initialScore)
+      : move(rootMove), score(initialScore), previousScore(initialScore) {}
+
+    Move move;
+    int score;
+    int previousScore;
+    int depth = 0;
+    std::vector<Move> pv;
+  };
+
+  ThreadPool& threadPool;
+  TranspositionTable& transpositionTable;
+  const int threadIndex;
+
   int currentPly;
-  uint64_t searchStartTime;
-  uint32_t nodesSearched;
-  bool searchStopped;
-  uint64_t timeAllocated;
-  
+  std::atomic<uint64_t> nodesSearched;
+
+  Move bestMove;
+  Move ponderMove;
+  int bestScore;
+  int completedDepth;
+  std::vector<Move> bestLine;
+
   std::array<std::array<Move, MAX_PLY>, 2> killerMoves;
-  std::array<std::array<int, 64>, 12> historyMoves;
+  HistoryTable historyMoves;
   std::array<uint64_t, 1024> repetitionTable;
   int repetitionIndex;
-  
-  bool scorePrincipalVariation;
+  std::array<StateInfo, MAX_PLY> stateStack;
+  AccumulatorStack accumulators;
+
+  std::vector<RootMove> rootMoves;
+  size_t pvIndex;
+
   bool followPrincipalVariation;
   std::array<int, MAX_PLY> principalVariationLengths;
   std::array<std::array<Move, MAX_PLY>, MAX_PLY> principalVariationTable;
-  
-  int calculateMoveScore(Move move, const Board& board) const;
-  void sortMoves(MoveArray& moves, const Board& board) const;
+
   bool isPositionRepeated(uint64_t hashKey) const;
-  bool isTimeExpired() const;
-  void enablePrincipalVariationScoring(const MoveArray& moves);
-  
+  bool isSearchStopped() const;
+  void checkTime();
+  void countNode();
+  void makeMove(Board& board, Move move);
+  void unmakeMove(Board& board, Move move);
+  void makeNullMove(Board& board);
+  void unmakeNullMove(Board& board);
+  Move principalVariationMove(const Board& board);
+  void printSearchInfo(int depth, int multiPV) const;
+  void printLine(int lineNumber, int score, int depth, uint64_t nodes, const std::vector<Move>& pv) const;
+
+  void initRootMoves(const Board& board);
+  bool isRootMoveSearchable(Move move) const;
+  void updateRootMove(Move move, int score, int depth, bool isBest);
+  void loadPrincipalVariation(const RootMove& rootMove);
+
   int quiescenceSearch(int alpha, int beta, Board& board);
   int negamaxSearch(int alpha, int beta, int depth, Board& board);
-};
\ No newline at end of file
+};
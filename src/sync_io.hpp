@@ -0,0 +1,11 @@
+#pragma once
+
+#include <iostream>
+#include <mutex>
+
+// The UCI thread and the main search thread both write to std::cout.
+// Whole lines are written under this lock so they never interleave.
+inline std::mutex& outputMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
@@ -0,0 +1,297 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <map>
+#include "numa.hpp"
+#include "sync_io.hpp"
+
+SearchThread::SearchThread(ThreadPool& pool, int threadIndex)
+  : threadPool(pool),
+    searchEngine(pool, threadIndex),
+    depthLimit(0),
+    searching(true),
+    exitRequested(false),
+    nativeThread([this, threadIndex] {
+      NumaTopology::system().bindCurrentThread(threadIndex);
+      idleLoop();
+    }) {
+  waitForSearchFinished();
+}
+
+SearchThread::~SearchThread() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    exitRequested = true;
+    searching = true;
+  }
+  condition.notify_all();
+  nativeThread.join();
+}
+
+void SearchThread::startSearching(const Board& board, int maxDepth) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    rootBoard = board;
+    depthLimit = maxDepth;
+    searchEngine.resetNodesSearched();
+    searching = true;
+  }
+  condition.notify_all();
+}
+
+void SearchThread::runJob(std::function<void()> work) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = std::move(work);
+    searching = true;
+  }
+  condition.notify_all();
+}
+
+void SearchThread::waitForSearchFinished() {
+  std::unique_lock<std::mutex> lock(mutex);
+  condition.wait(lock, [this] { return !searching; });
+}
+
+void SearchThread::idleLoop() {
+  while (true) {
+    std::unique_lock<std::mutex> lock(mutex);
+    searching = false;
+    condition.notify_all();
+    condition.wait(lock, [this] { return searching; });
+
+    if (exitRequested) {
+      return;
+    }
+
+    lock.unlock();
+
+    if (job) {
+      job();
+      job = nullptr;
+      continue;
+    }
+
+    searchEngine.iterativeDeepening(rootBoard, depthLimit);
+
+    if (searchEngine.isMainThread()) {
+      threadPool.onMainSearchFinished();
+    }
+  }
+}
+
+ThreadPool::ThreadPool(int hashSizeMB)
+  : transpositionTable(hashSizeMB),
+    multiPV(1),
+    stopRequested(false),
+    pondering(false),
+    searchStartTime(0) {
+  setThreadCount(1);
+  clearHash();
+}
+
+ThreadPool::~ThreadPool() {
+  stopSearch();
+  if (!threads.empty()) {
+    waitForSearchFinished();
+  }
+  threads.clear();
+}
+
+void ThreadPool::setThreadCount(int count) {
+  count = std::clamp(count, 1, MAX_THREADS);
+
+  const bool replacing = !threads.empty();
+  if (replacing) {
+    waitForSearchFinished();
+  }
+  threads.clear();
+
+  for (int i = 0; i < count; ++i) {
+    threads.push_back(std::make_unique<SearchThread>(*this, i));
+  }
+
+  // Pages stay on the node that first touched them, so clearing alone would
+  // not move them to the nodes of the new threads. A private table is
+  // allocated afresh for them to place instead.
+  if (replacing && NumaTopology::system().nodeCount() > 1 && transpositionTable.isPrivate()) {
+    transpositionTable.initialize(transpositionTable.sizeInMB());
+    clearHash();
+  }
+}
+
+int ThreadPool::setHashSize(int sizeInMB) {
+  waitForSearchFinished();
+  const int obtained = transpositionTable.initialize(std::clamp(sizeInMB, 1, MAX_HASH_MB));
+  clearHash();
+  return obtained;
+}
+
+// Every search thread clears a slice, which takes a fraction of the time on
+// a big table and leaves each slice's pages on the node of a thread that
+// probes it.
+void ThreadPool::clearHash() {
+  waitForSearchFinished();
+
+  const size_t count = threads.size();
+  for (size_t i = 0; i < count; ++i) {
+    threads[i]->runJob([this, i, count] { transpositionTable.clearSlice(i, count); });
+  }
+  for (auto& thread : threads) {
+    thread->waitForSearchFinished();
+  }
+}
+
+void ThreadPool::setMultiPV(int lines) {
+  multiPV = std::clamp(lines, 1, MAX_MULTI_PV);
+}
+
+void ThreadPool::resetRepetitionTable() {
+  for (auto& thread : threads) {
+    thread->getSearch().resetRepetitionTable();
+  }
+}
+
+// While pondering the clock belongs to the opponent, so time never runs out.
+bool ThreadPool::isTimeExpired() const {
+  if (pondering.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  return static_cast<uint64_t>(getCurrentTimeMilliseconds() - searchStartTime.load(std::memory_order_relaxed))
+         > limits.timeAllocated;
+}
+
+uint64_t ThreadPool::getNodesSearched() const {
+  uint64_t nodes = 0;
+  for (const auto& thread : threads) {
+    nodes += thread->getSearch().getNodesSearched();
+  }
+  return nodes;
+}
+
+// Hands the position to the search threads and returns at once, so the UCI
+// thread keeps reading commands while they search.
+void ThreadPool::startThinking(const Board& board, const SearchLimits& searchLimits) {
+  waitForSearchFinished();
+
+  limits = searchLimits;
+  stopRequested.store(false, std::memory_order_relaxed);
+  pondering.store(limits.ponder, std::memory_order_relaxed);
+  searchStartTime.store(getCurrentTimeMilliseconds(), std::memory_order_relaxed);
+  transpositionTable.newSearch();
+
+  for (size_t i = 1; i < threads.size(); ++i) {
+    threads[i]->startSearching(board, limits.depth);
+  }
+  threads.front()->startSearching(board, limits.depth);
+}
+
+void ThreadPool::waitForSearchFinished() {
+  threads.front()->waitForSearchFinished();
+}
+
+void ThreadPool::stopSearch() {
+  {
+    std::lock_guard<std::mutex> lock(stopMutex);
+    stopRequested.store(true, std::memory_order_relaxed);
+  }
+  stopCondition.notify_all();
+}
+
+// The opponent played the expected move: the running ponder search simply
+// becomes a normal timed search, keeping its tree, tables and heuristics.
+void ThreadPool::ponderhit() {
+  {
+    std::lock_guard<std::mutex> lock(stopMutex);
+    searchStartTime.store(getCurrentTimeMilliseconds(), std::memory_order_relaxed);
+    pondering.store(false, std::memory_order_relaxed);
+  }
+  stopCondition.notify_all();
+}
+
+// Runs on the main search thread once its iterative deepening loop is done.
+void ThreadPool::onMainSearchFinished() {
+  // In infinite or ponder mode bestmove may only be sent after the GUI
+  // says stop (or ponderhit, for a finished ponder search).
+  {
+    std::unique_lock<std::mutex> lock(stopMutex);
+    stopCondition.wait(lock, [this] {
+      return isStopRequested() || (!limits.infinite && !pondering.load(std::memory_order_relaxed));
+    });
+  }
+
+  stopSearch();
+
+  for (size_t i = 1; i < threads.size(); ++i) {
+    threads[i]->waitForSearchFinished();
+  }
+
+  const ChessSearch& bestThread = pickBestThread();
+  if (!bestThread.isMainThread()) {
+    bestThread.printBestLine();
+  }
+
+  const Move bestMove = bestThread.getBestMove();
+  const Move ponderMove = bestThread.getPonderMove();
+  const std::string bestMoveString = bestMove.get_body() ? ChessSearch::moveToString(bestMove) : "none";
+
+  std::lock_guard<std::mutex> lock(outputMutex());
+  std::cout << "bestmove " << bestMoveString;
+  if (bestMove.get_body() && ponderMove.get_body()) {
+    std::cout << " ponder " << ChessSearch::moveToString(ponderMove);
+  }
+  std::cout << std::endl;
+}
+
+// Thread voting: each thread votes for its best move with a weight that grows
+// with the depth it completed and with how much its score beats the worst one.
+const ChessSearch& ThreadPool::pickBestThread() const {
+  const ChessSearch* bestThread = &threads.front()->getSearch();
+
+  if (threads.size() == 1) {
+    return *bestThread;
+  }
+
+  int minScore = ChessSearch::MATE_VALUE;
+  for (const auto& thread : threads) {
+    const ChessSearch& search = thread->getSearch();
+    if (search.getCompletedDepth() > 0) {
+      minScore = std::min(minScore, search.getBestScore());
+    }
+  }
+
+  std::map<uint32_t, int64_t> votes;
+  for (const auto& thread : threads) {
+    const ChessSearch& search = thread->getSearch();
+    if (search.getCompletedDepth() > 0) {
+      votes[search.getBestMove().get_body()] +=
+        static_cast<int64_t>(search.getBestScore() - minScore + 14) * search.getCompletedDepth();
+    }
+  }
+
+  for (const auto& thread : threads) {
+    const ChessSearch& search = thread->getSearch();
+    if (search.getCompletedDepth() == 0) {
+      continue;
+    }
+
+    if (bestThread->getCompletedDepth() == 0) {
+      bestThread = &search;
+      continue;
+    }
+
+    // A proven mate is never outvoted; prefer the shortest one.
+    if (bestThread->getBestScore() > ChessSearch::MATE_SCORE) {
+      if (search.getBestScore() > bestThread->getBestScore()) {
+        bestThread = &search;
+      }
+      continue;
+    }
+
+    if (search.getBestScore() > ChessSearch::MATE_SCORE ||
+        votes[search.getBestMove().get_body()] > votes[bestThread->getBestMove().get_body()]) {
+      bestThread = &search;
+    }
+  }
+
+  return *bestThread;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "board.hpp"
+#include "search.hpp"
+#include "transposition_table.hpp"
+
+class ThreadPool;
+
+struct SearchLimits {
+  int depth = 255;
+  uint64_t timeAllocated = INT64_MAX;
+  bool infinite = false;
+  bool ponder = false;
+};
+
+// A native thread parked in an idle loop. It owns one ChessSearch with its own
+// board copy, search stack and move-ordering heuristics.
+class SearchThread {
+public:
+  SearchThread(ThreadPool& pool, int threadIndex);
+  ~SearchThread();
+
+  SearchThread(const SearchThread&) = delete;
+  SearchThread& operator=(const SearchThread&) = delete;
+
+  void startSearching(const Board& board, int maxDepth);
+  // Runs a job other than a search, e.g. a share of some setup work, on
+  // this thread. waitForSearchFinished() waits for it as well.
+  void runJob(std::function<void()> work);
+  void waitForSearchFinished();
+
+  ChessSearch& getSearch() { return searchEngine; }
+  const ChessSearch& getSearch() const { return searchEngine; }
+
+private:
+  void idleLoop();
+
+  ThreadPool& threadPool;
+  ChessSearch searchEngine;
+  Board rootBoard;
+  int depthLimit;
+  std::function<void()> job;
+
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool searching;
+  bool exitRequested;
+  std::thread nativeThread;
+};
+
+// Lazy SMP: every thread searches the same root position independently and
+// they only cooperate through the shared transposition table.
+class ThreadPool {
+public:
+  static constexpr int MAX_THREADS = 512;
+  static constexpr int MAX_MULTI_PV = 256;
+  static constexpr int MAX_HASH_MB = 65536;
+
+  explicit ThreadPool(int hashSizeMB);
+  ~ThreadPool();
+
+  void setThreadCount(int count);
+  size_t size() const { return threads.size(); }
+
+  // Returns the size obtained, which is smaller when memory is short.
+  int setHashSize(int sizeInMB);
+  void clearHash();
+
+  void setMultiPV(int lines);
+  int getMultiPV() const { return multiPV; }
+
+  void resetRepetitionTable();
+  void startThinking(const Board& board, const SearchLimits& searchLimits);
+  void waitForSearchFinished();
+
+  void stopSearch();
+  void ponderhit();
+  bool isStopRequested() const { return stopRequested.load(std::memory_order_relaxed); }
+  bool isTimeExpired() const;
+
+  uint64_t getNodesSearched() const;
+  TranspositionTable& getTranspositionTable() { return transpositionTable; }
+
+private:
+  friend class SearchThread;
+
+  TranspositionTable transpositionTable;
+  std::vector<std::unique_ptr<SearchThread>> threads;
+  int multiPV;
+  std::atomic<bool> stopRequested;
+  std::mutex stopMutex;
+  std::condition_variable stopCondition;
+  SearchLimits limits;
+  std::atomic<bool> pondering;
+  std::atomic<int64_t> searchStartTime;
+
+  void onMainSearchFinished();
+  const ChessSearch& pickBestThread() const;
+};
@@ -0,0 +1,231 @@
+#include "transposition_table.hpp"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+  // The clusters follow the header as they are laid out in memory, words in
+  // the byte order of the machine that wrote them. A file from a machine
+  // of the other byte order fails the version check.
+  struct alignas(64) TranspositionFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t clusterBytes;
+    uint64_t clusterCount;
+    uint8_t generation;
+  };
+
+  constexpr char FILE_MAGIC[8] = "MOPHASH";
+  constexpr uint32_t FILE_VERSION = 2; // 2: score mixed into the key check by a multiply
+
+  // How long a process attaching to a shared table waits for the one that
+  // created it to publish the header
+  constexpr int SHARED_WAIT_MS = 1000;
+
+  static_assert(sizeof(TranspositionFileHeader) == sizeof(TranspositionCluster),
+                "The clusters of a table file should stay cache-line aligned");
+
+  std::string segmentName(const std::string& name) {
+    return name[0] == '/' ? name : "/" + name;
+  }
+}
+
+void TranspositionTable::release() {
+  if (fileView) {
+    unmap_file(fileView, fileMapping);
+    fileView = nullptr;
+  } else {
+    free_large(clusters, clusterCount * sizeof(TranspositionCluster));
+  }
+  clusters = nullptr;
+  clusterCount = 0;
+  sharedGeneration = nullptr;
+  sharedName.clear();
+}
+
+namespace {
+  // Flushes a written file through to the disk, so that a rename after it
+  // cannot leave a table that is complete in name only after a crash.
+  bool syncFile(std::FILE* file) {
+    if (std::fflush(file) != 0) {
+      return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+  }
+
+  int processId() {
+#ifdef _WIN32
+    return _getpid();
+#else
+    return static_cast<int>(getpid());
+#endif
+  }
+}
+
+// Written under a temporary name of this process first, so that a table
+// being loaded is never a partly written one, even when several engines
+// save to the same path.
+bool TranspositionTable::save(const std::string& path) const {
+  TranspositionFileHeader header{};
+  std::memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+  header.version = FILE_VERSION;
+  header.clusterBytes = sizeof(TranspositionCluster);
+  header.clusterCount = clusterCount;
+  header.generation = currentGeneration();
+
+  const std::string tmpPath = path + "." + std::to_string(processId()) + ".tmp";
+  std::FILE* file = std::fopen(tmpPath.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  bool written = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+                 std::fwrite(clusters, sizeof(TranspositionCluster), clusterCount, file) == clusterCount &&
+                 syncFile(file);
+  written = std::fclose(file) == 0 && written;
+
+  if (!written || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+    std::remove(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool TranspositionTable::load(const std::string& path) {
+  FD fd = open_file(path.c_str());
+  if (fd == FD_ERR) {
+    return false;
+  }
+
+  const size_t size = file_size(fd);
+  map_t mapping{};
+  void* view = size > sizeof(TranspositionFileHeader) ? map_file_private(fd, &mapping) : nullptr;
+  close_file(fd);
+  if (!view) {
+    return false;
+  }
+
+  const auto* header = static_cast<const TranspositionFileHeader*>(view);
+  if (std::memcmp(header->magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 ||
+      header->version != FILE_VERSION ||
+      header->clusterBytes != sizeof(TranspositionCluster) ||
+      header->clusterCount == 0 ||
+      size != sizeof(TranspositionFileHeader) + header->clusterCount * sizeof(TranspositionCluster)) {
+    unmap_file(view, mapping);
+    return false;
+  }
+
+  release();
+  fileView = view;
+  fileMapping = mapping;
+  pages = PAGES_SMALL;
+  clusterCount = header->clusterCount;
+  generation = header->generation;
+  clusters = reinterpret_cast<TranspositionCluster*>(static_cast<char*>(view) + sizeof(TranspositionFileHeader));
+  return true;
+}
+
+// A shared table is laid out like a table file. Its creator publishes the
+// version last, so a process that sees it finds the rest of the header set.
+// A creator that fails before that removes the segment again, so that it
+// does not keep the name from the next attempt.
+bool TranspositionTable::attachShared(const std::string& name) {
+#ifdef _WIN32
+  (void)name;
+  return false;
+#else
+  const std::string segment = segmentName(name);
+  bool created = true;
+  int fd = shm_open(segment.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    created = false;
+    fd = shm_open(segment.c_str(), O_RDWR, 0);
+  }
+  if (fd < 0) {
+    return false;
+  }
+
+  const size_t createdSize = sizeof(TranspositionFileHeader) + clusterCount * sizeof(TranspositionCluster);
+  if (created && ftruncate(fd, createdSize) != 0) {
+    close(fd);
+    shm_unlink(segment.c_str());
+    return false;
+  }
+
+  size_t size = file_size(fd);
+  for (int waited = 0; size == 0 && waited < SHARED_WAIT_MS; ++waited) {
+    usleep(1000);
+    size = file_size(fd);
+  }
+
+  // Faulting the segment in up front keeps the page faults out of the search.
+#ifdef MAP_POPULATE
+  const int flags = MAP_SHARED | MAP_POPULATE;
+#else
+  const int flags = MAP_SHARED;
+#endif
+  void* view = size > sizeof(TranspositionFileHeader)
+    ? mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, fd, 0)
+    : MAP_FAILED;
+  close(fd);
+  if (view == MAP_FAILED) {
+    if (created) {
+      shm_unlink(segment.c_str());
+    }
+    return false;
+  }
+
+  auto* header = static_cast<TranspositionFileHeader*>(view);
+  if (created) {
+    std::memcpy(header->magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+    header->clusterBytes = sizeof(TranspositionCluster);
+    header->clusterCount = clusterCount;
+    header->generation = currentGeneration();
+    __atomic_store_n(&header->version, FILE_VERSION, __ATOMIC_RELEASE);
+  } else {
+    for (int waited = 0; !__atomic_load_n(&header->version, __ATOMIC_ACQUIRE) && waited < SHARED_WAIT_MS; ++waited) {
+      usleep(1000);
+    }
+  }
+
+  if (__atomic_load_n(&header->version, __ATOMIC_ACQUIRE) != FILE_VERSION ||
+      std::memcmp(header->magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 ||
+      header->clusterBytes != sizeof(TranspositionCluster) ||
+      header->clusterCount == 0 ||
+      size != sizeof(TranspositionFileHeader) + header->clusterCount * sizeof(TranspositionCluster)) {
+    munmap(view, size);
+    return false;
+  }
+
+  release();
+  fileView = view;
+  fileMapping = size;
+  pages = PAGES_SMALL;
+  clusterCount = header->clusterCount;
+  clusters = reinterpret_cast<TranspositionCluster*>(static_cast<char*>(view) + sizeof(TranspositionFileHeader));
+  sharedGeneration = &header->generation;
+  sharedName = name;
+  return true;
+#endif
+}
+
+bool TranspositionTable::unlinkShared(const std::string& name) {
+#ifdef _WIN32
+  (void)name;
+  return false;
+#else
+  return !name.empty() && shm_unlink(segmentName(name).c_str()) == 0;
+#endif
+}
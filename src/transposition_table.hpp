@@ -1,8 +1,11 @@
 #pragma once
 
-#include <iostream>
-#include <vector>
-#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <string>
+#include "./nnue/misc.h"
 
 enum class HashFlag {
   EXACT,
@@ -10,95 +13,358 @@ enum class HashFlag {
   BETA
 };
 
+// The cluster is picked by the high bits of the key, so only the low 16 bits
+// are kept to tell the positions of a cluster apart.
 struct TranspositionEntry {
-  uint64_t hashKey;
+  static constexpr uint8_t FLAG_MASK = 0x3;
+
+  uint16_t key16;
+  uint16_t move16;
+  int32_t score;
+  int16_t eval;
+  uint8_t depth8;
+  uint8_t genBound8; // generation in the high 6 bits, flag + 1 in the low 2 (0 = empty)
+};
+
+// Holds an entry in three words that are each read and written atomically,
+// so the search threads share the table without locks. The key is stored
+// XORed with a fold of the other fields: a probe that races a store and
+// reads words of two different entries gets a key that matches neither.
+// The generation is left out of the fold so that a hit can refresh it alone.
+class TranspositionSlot {
+private:
+  std::atomic<uint32_t> keyMove;      // checked key16 | move16 << 16
+  std::atomic<uint32_t> score;
+  std::atomic<uint32_t> evalDepthGen; // eval | depth8 << 16 | genBound8 << 24
+
+  static uint16_t check(const TranspositionEntry& entry) {
+    // The multiply spreads every bit of the score into the high half, so
+    // a score and its complement do not fold to the same value.
+    const uint32_t scoreMix = static_cast<uint32_t>(entry.score) * 0x9E3779B1u;
+    return static_cast<uint16_t>(entry.move16 ^ (scoreMix >> 16) ^ static_cast<uint16_t>(entry.eval) ^ entry.depth8 ^
+                                 ((entry.genBound8 & TranspositionEntry::FLAG_MASK) << 8));
+  }
+
+  static uint32_t packEvalDepthGen(const TranspositionEntry& entry) {
+    return static_cast<uint16_t>(entry.eval) | (entry.depth8 << 16) | (static_cast<uint32_t>(entry.genBound8) << 24);
+  }
+
+public:
+  TranspositionEntry load() const {
+    const uint32_t keyMoveWord = keyMove.load(std::memory_order_relaxed);
+    const uint32_t evalDepthGenWord = evalDepthGen.load(std::memory_order_relaxed);
+
+    TranspositionEntry entry;
+    entry.move16 = static_cast<uint16_t>(keyMoveWord >> 16);
+    entry.score = static_cast<int32_t>(score.load(std::memory_order_relaxed));
+    entry.eval = static_cast<int16_t>(evalDepthGenWord);
+    entry.depth8 = static_cast<uint8_t>(evalDepthGenWord >> 16);
+    entry.genBound8 = static_cast<uint8_t>(evalDepthGenWord >> 24);
+    entry.key16 = static_cast<uint16_t>(keyMoveWord) ^ check(entry);
+    return entry;
+  }
+
+  void store(const TranspositionEntry& entry) {
+    score.store(static_cast<uint32_t>(entry.score), std::memory_order_relaxed);
+    evalDepthGen.store(packEvalDepthGen(entry), std::memory_order_relaxed);
+    keyMove.store(static_cast<uint16_t>(entry.key16 ^ check(entry)) | (static_cast<uint32_t>(entry.move16) << 16),
+                  std::memory_order_relaxed);
+  }
+
+  // Gives a loaded entry a new generation, unless another thread has
+  // rewritten the slot since.
+  void refresh(const TranspositionEntry& entry, uint8_t genBound8) {
+    uint32_t expected = packEvalDepthGen(entry);
+    evalDepthGen.compare_exchange_strong(expected, (expected & 0xFFFFFF) | (static_cast<uint32_t>(genBound8) << 24),
+                                         std::memory_order_relaxed);
+  }
+};
+
+static_assert(sizeof(TranspositionSlot) == 12, "TranspositionSlot should be 12 bytes");
+
+// One cache line: a probe or a store never touches more than that.
+struct alignas(64) TranspositionCluster {
+  static constexpr int ENTRY_COUNT = 5;
+
+  TranspositionSlot entries[ENTRY_COUNT];
+};
+
+static_assert(sizeof(TranspositionCluster) == 64, "TranspositionCluster should be one cache line");
+
+// A probe hit. move is Move::to_compact() of the best move found, or 0.
+struct TranspositionData {
+  uint16_t move;
+  int score;
+  int eval;
   int depth;
   HashFlag flag;
-  int score;
 };
 
 class TranspositionTable {
 private:
-  std::vector<TranspositionEntry> entries;
-  size_t tableSize;
-  
+  TranspositionCluster* clusters = nullptr;
+  size_t clusterCount = 0;
+  PageKind pages = PAGES_SMALL;
+  uint8_t generation = 0;
+
+  // Set while the clusters live in a mapping made by load() or attachShared()
+  void* fileView = nullptr;
+  map_t fileMapping{};
+
+  // Set while attached to a shared segment. Its header holds the generation,
+  // so that the processes age each other's entries at the same pace.
+  uint8_t* sharedGeneration = nullptr;
+  std::string sharedName;
+
   static constexpr int MATE_SCORE = 48000;
-  static constexpr int NO_HASH_FOUND = 100000;
-  static constexpr int BYTES_PER_MB = 0x100000;
+  static constexpr size_t BYTES_PER_MB = 0x100000;
+
+  static constexpr uint8_t FLAG_MASK = TranspositionEntry::FLAG_MASK;
+  static constexpr uint8_t GENERATION_DELTA = FLAG_MASK + 1;
+  static constexpr uint8_t GENERATION_MASK = static_cast<uint8_t>(~FLAG_MASK);
+  // Keeps the flag bits of an entry from borrowing from its age
+  static constexpr int GENERATION_CYCLE = 0xFF + GENERATION_DELTA;
+  static constexpr int MAX_DEPTH = 255;
+
+  // An entry from the current search may only be replaced by a deeper one
+  // of the same position, unless it is exact or not much deeper.
+  static constexpr int DEPTH_MARGIN = 4;
+  // Depth an entry is worth less per search it has not been used in
+  static constexpr int AGE_PENALTY = 8;
 
 public:
+  // Eval of an entry whose position was never evaluated
+  static constexpr int NO_EVAL = INT16_MIN;
+  static constexpr int MAX_EVAL = INT16_MAX;
+
   explicit TranspositionTable(int sizeInMB) {
     initialize(sizeInMB);
   }
 
-  void initialize(int sizeInMB) {
-    const size_t totalBytes = BYTES_PER_MB * sizeInMB;
-    tableSize = totalBytes / sizeof(TranspositionEntry);
-    
-    try {
-      entries.resize(tableSize);
-      clear();
-      
-      std::cout << "Transposition table initialized with " << tableSize 
-                << " entries (" << sizeInMB << "MB)" << std::endl;
-    }
-    catch (const std::bad_alloc& e) {
+  ~TranspositionTable() {
+    release();
+  }
+
+  TranspositionTable(const TranspositionTable&) = delete;
+  TranspositionTable& operator=(const TranspositionTable&) = delete;
+
+  // Random probes over a big table miss the TLB on small pages, so the
+  // clusters come from alloc_large. They come zeroed and are left untouched,
+  // so that clearSlice() can place them. Halves the size until the
+  // allocation succeeds and returns the size obtained in MB.
+  int initialize(int sizeInMB) {
+    release();
+    clusterCount = BYTES_PER_MB * sizeInMB / sizeof(TranspositionCluster);
+    clusters = static_cast<TranspositionCluster*>(
+      alloc_large(clusterCount * sizeof(TranspositionCluster), &pages));
+
+    if (!clusters) {
+      clusterCount = 0;
       if (sizeInMB > 1) {
-        const int halfSize = sizeInMB / 2;
-        std::cout << "Memory allocation failed, retrying with " 
-                  << halfSize << "MB..." << std::endl;
-        initialize(halfSize);
-      } else {
-        std::cout << "Failed to allocate minimum transposition table size!" << std::endl;
-        throw;
+        return initialize(sizeInMB / 2);
+      }
+      throw std::bad_alloc();
+    }
+
+    generation = 0;
+    return sizeInMB;
+  }
+
+  // Zeroes the index-th of count equal slices of the clusters. Memory is
+  // placed on the NUMA node of the thread that touches it first, so threads
+  // clearing one slice each also spread a fresh table over their nodes.
+  void clearSlice(size_t index, size_t count) {
+    const size_t begin = clusterCount * index / count;
+    const size_t end = clusterCount * (index + 1) / count;
+
+    for (size_t i = begin; i < end; ++i) {
+      for (auto& slot : clusters[i].entries) {
+        slot.store(TranspositionEntry{});
       }
     }
   }
 
   void clear() {
-    for (auto& entry : entries) {
-      entry.hashKey = 0;
-      entry.depth = 0;
-      entry.flag = HashFlag::EXACT;
-      entry.score = 0;
+    clearSlice(0, 1);
+    generation = 0;
+    if (sharedGeneration) {
+      __atomic_store_n(sharedGeneration, 0, __ATOMIC_RELAXED);
     }
   }
 
-  int probe(int alpha, int beta, int depth, uint64_t hashKey, int ply) const {
-    const TranspositionEntry& entry = entries[hashKey % tableSize];
-    
-    if (entry.hashKey != hashKey || entry.depth < depth) {
-      return NO_HASH_FOUND;
+  // Called before every search, so that the entries of earlier searches age
+  // and are the first to be replaced. A shared table ages with the searches
+  // of every attached process.
+  void newSearch() {
+    if (sharedGeneration) {
+      __atomic_add_fetch(sharedGeneration, GENERATION_DELTA, __ATOMIC_RELAXED);
+    } else {
+      generation += GENERATION_DELTA;
     }
+  }
+
+  // Copies the entry of the position into data, with the score adjusted to
+  // the probing ply. Whether the score cuts is up to the caller.
+  bool probe(uint64_t hashKey, int ply, TranspositionData& data) {
+    TranspositionEntry entry;
 
-    int adjustedScore = adjustScoreFromTable(entry.score, ply);
-    
-    switch (entry.flag) {
-      case HashFlag::EXACT:
-        return adjustedScore;
-      case HashFlag::ALPHA:
-        return (adjustedScore <= alpha) ? alpha : NO_HASH_FOUND;
-      case HashFlag::BETA:
-        return (adjustedScore >= beta) ? beta : NO_HASH_FOUND;
+    if (!findEntry(hashKey, entry)) {
+      return false;
     }
-    
-  return NO_HASH_FOUND;
+
+    data.move = entry.move16;
+    data.score = adjustScoreFromTable(entry.score, ply);
+    data.eval = entry.eval;
+    data.depth = entry.depth8;
+    data.flag = getFlag(entry);
+    return true;
   }
 
-  void store(int score, int depth, HashFlag flag, uint64_t hashKey, int ply) {
-    TranspositionEntry& entry = entries[hashKey % tableSize];
-    
-    entry.hashKey = hashKey;
-    entry.score = adjustScoreForTable(score, ply);
-    entry.flag = flag;
-    entry.depth = depth;
+  // Writes over the entry of the position if it is in the cluster, otherwise
+  // over the least valuable one: an empty slot, or the shallowest after aging.
+  // An empty move or NO_EVAL keeps what the entry already knew about the
+  // same position.
+  void store(int score, int depth, HashFlag flag, uint64_t hashKey, int ply,
+             uint16_t move = 0, int eval = NO_EVAL) {
+    TranspositionCluster& cluster = clusterFor(hashKey);
+    const uint16_t key16 = static_cast<uint16_t>(hashKey);
+    const uint8_t gen = currentGeneration();
+    TranspositionSlot* replaceSlot = &cluster.entries[0];
+    TranspositionEntry replace = replaceSlot->load();
+
+    for (TranspositionSlot& slot : cluster.entries) {
+      const TranspositionEntry entry = slot.load();
+      if (entry.key16 == key16 || !isOccupied(entry)) {
+        replaceSlot = &slot;
+        replace = entry;
+        break;
+      }
+      if (replacementValue(entry, gen) < replacementValue(replace, gen)) {
+        replaceSlot = &slot;
+        replace = entry;
+      }
+    }
+
+    const bool samePosition = replace.key16 == key16 && isOccupied(replace);
+
+    if (move || !samePosition) {
+      replace.move16 = move;
+    }
+    if (eval != NO_EVAL || !samePosition) {
+      replace.eval = static_cast<int16_t>(std::clamp(eval, NO_EVAL, MAX_EVAL));
+    }
+
+    if (flag == HashFlag::EXACT || !samePosition ||
+        depth + DEPTH_MARGIN > replace.depth8 || relativeAge(replace, gen) != 0) {
+      replace.key16 = key16;
+      replace.score = adjustScoreForTable(score, ply);
+      replace.depth8 = static_cast<uint8_t>(depth < MAX_DEPTH ? depth : MAX_DEPTH);
+      replace.genBound8 = static_cast<uint8_t>(gen | (static_cast<uint8_t>(flag) + 1));
+    }
+
+    replaceSlot->store(replace);
+  }
+
+  // Starts loading the cluster of a position that is about to be probed.
+  void prefetch(uint64_t hashKey) const {
+    __builtin_prefetch(&clusters[clusterIndex(hashKey)]);
   }
 
+  // Number of entries
   size_t size() const {
-    return tableSize;
+    return clusterCount * TranspositionCluster::ENTRY_COUNT;
   }
 
+  int sizeInMB() const {
+    return static_cast<int>(clusterCount * sizeof(TranspositionCluster) / BYTES_PER_MB);
+  }
+
+  PageKind pageKind() const {
+    return pages;
+  }
+
+  // False while the table is a loaded file or a shared segment, which are
+  // there to carry results over and are not cleared between games.
+  bool isPrivate() const {
+    return !fileView;
+  }
+
+  // Name of the shared segment the table is attached to, or empty
+  const std::string& sharedSegment() const {
+    return sharedName;
+  }
+
+  // Writes the table to a file that load() can map back in.
+  bool save(const std::string& path) const;
+
+  // Replaces the table with one written by save(), whatever its size. The
+  // file is mapped copy-on-write, so it is usable at once and each cluster
+  // is only read from disk when the search first touches it.
+  bool load(const std::string& path);
+
+  // Moves the table into the named POSIX shared memory segment, creating it
+  // with the current size when no other process has. Processes attached to
+  // the same segment probe and store each other's entries. They should use
+  // the same network, since the entries hold its evals.
+  bool attachShared(const std::string& name);
+
+  // Removes the name of a shared segment, so that the next process to
+  // attach creates a new one. Processes attached to it keep using it until
+  // they detach, which is when its memory is freed.
+  static bool unlinkShared(const std::string& name);
+
 private:
+  void release();
+
+  uint8_t currentGeneration() const {
+    return sharedGeneration ? __atomic_load_n(sharedGeneration, __ATOMIC_RELAXED) : generation;
+  }
+
+  // Multiply-shift maps the key onto the clusters without a division.
+  size_t clusterIndex(uint64_t hashKey) const {
+    return static_cast<size_t>((static_cast<unsigned __int128>(hashKey) * clusterCount) >> 64);
+  }
+
+  TranspositionCluster& clusterFor(uint64_t hashKey) {
+    return clusters[clusterIndex(hashKey)];
+  }
+
+  // A hit also marks the entry as used by the current search.
+  bool findEntry(uint64_t hashKey, TranspositionEntry& found) {
+    TranspositionCluster& cluster = clusterFor(hashKey);
+    const uint16_t key16 = static_cast<uint16_t>(hashKey);
+    const uint8_t gen = currentGeneration();
+
+    for (TranspositionSlot& slot : cluster.entries) {
+      const TranspositionEntry entry = slot.load();
+      if (entry.key16 == key16 && isOccupied(entry)) {
+        if ((entry.genBound8 & GENERATION_MASK) != gen) {
+          slot.refresh(entry, static_cast<uint8_t>(gen | (entry.genBound8 & FLAG_MASK)));
+        }
+        found = entry;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool isOccupied(const TranspositionEntry& entry) {
+    return entry.genBound8 & FLAG_MASK;
+  }
+
+  static HashFlag getFlag(const TranspositionEntry& entry) {
+    return static_cast<HashFlag>((entry.genBound8 & FLAG_MASK) - 1);
+  }
+
+  // Searches since the entry was last written or hit
+  static int relativeAge(const TranspositionEntry& entry, uint8_t gen) {
+    return ((GENERATION_CYCLE + gen - entry.genBound8) & GENERATION_MASK) / GENERATION_DELTA;
+  }
+
+  static int replacementValue(const TranspositionEntry& entry, uint8_t gen) {
+    return entry.depth8 - AGE_PENALTY * relativeAge(entry, gen);
+  }
+
   int adjustScoreFromTable(int score, int ply) const {
     if (score < -MATE_SCORE) {
       return score + ply;
@@ -118,4 +384,4 @@ private:
     }
     return score;
   }
-};
\ No newline at end of file
+};
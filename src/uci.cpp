@@ -5,10 +5,12 @@
 #include <vector>
 #include <sstream>
 #include <algorithm>
+#include "numa.hpp"
+#include "sync_io.hpp"
 #include "./nnue/nnue.h"
 
-UciInterface::UciInterface() : searchEngine(64) {
-  nnue_init("nn-62ef826d1a6d.nnue");
+UciInterface::UciInterface() : searchThreads(DEFAULT_HASH_MB) {
+  defaultNetworkLoaded = nnue_init(DefaultEvalFile);
 }
 
 std::vector<std::string> UciInterface::splitString(const std::string& input, char delimiter) const {
@@ -83,18 +85,69 @@ void UciInterface::parseAndMakeMove(const std::string& moveString) {
 }
 
 void UciInterface::handleUciCommand() {
-  std::cout << "id name " << ENGINE_NAME << std::endl;
+  std::lock_guard<std::mutex> lock(outputMutex());
+  std::cout << "id name " << ENGINE_NAME << " (" << nnue_kernel_name() << ")" << std::endl;
   std::cout << "id author " << AUTHOR_NAME << std::endl;
+  std::cout << "option name Threads type spin default " << DEFAULT_THREADS
+            << " min 1 max " << ThreadPool::MAX_THREADS << std::endl;
+  std::cout << "option name Hash type spin default " << DEFAULT_HASH_MB
+            << " min 1 max " << ThreadPool::MAX_HASH_MB << std::endl;
+  std::cout << "option name Ponder type check default false" << std::endl;
+  std::cout << "option name MultiPV type spin default " << DEFAULT_MULTI_PV
+            << " min 1 max " << ThreadPool::MAX_MULTI_PV << std::endl;
+  std::cout << "option name EvalFile type string default " << DefaultEvalFile << std::endl;
+  std::cout << "option name HashFile type string default " << DEFAULT_HASH_FILE << std::endl;
+  std::cout << "option name SaveHash type button" << std::endl;
+  std::cout << "option name LoadHash type button" << std::endl;
+  std::cout << "option name SharedHash type string default <empty>" << std::endl;
+  std::cout << "option name UnlinkSharedHash type button" << std::endl;
   std::cout << "uciok" << std::endl;
 }
 
+// Reports the size the table got and the pages it is on, for the caller
+// that holds the output lock.
+void UciInterface::printHashInfo(int sizeInMB) {
+  const TranspositionTable& table = searchThreads.getTranspositionTable();
+  hashReported = true;
+  std::cout << "info string Hash " << sizeInMB << " MB, " << table.size() << " entries on "
+            << page_kind_name(table.pageKind()) << std::endl;
+}
+
+// Reports the network in use and what its weights are read from, for the
+// caller that holds the output lock.
+void UciInterface::printNetworkInfo(const std::string& evalFile) {
+  networkReported = true;
+  std::cout << "info string NNUE evaluation using " << evalFile << " ("
+            << nnue_network_name() << ", " << nnue_kernel_name() << ", "
+            << nnue_memory_name() << ")" << std::endl;
+}
+
+// The first answer also tells what the default table and network got,
+// unless Hash and EvalFile were set before.
 void UciInterface::handleIsReadyCommand() {
+  std::lock_guard<std::mutex> lock(outputMutex());
+  if (!hashReported) {
+    printHashInfo(searchThreads.getTranspositionTable().sizeInMB());
+  }
+  if (!networkReported) {
+    if (defaultNetworkLoaded) {
+      printNetworkInfo(DefaultEvalFile);
+    } else {
+      networkReported = true;
+      std::cout << "info string Could not load " << DefaultEvalFile << ", evaluating with "
+                << nnue_memory_name() << std::endl;
+    }
+  }
   std::cout << "readyok" << std::endl;
 }
 
 void UciInterface::handleNewGameCommand() {
+  searchThreads.waitForSearchFinished();
   chessBoard.load_fen(start_position);
-  searchEngine.resetRepetitionTable();
+  searchThreads.resetRepetitionTable();
+  if (searchThreads.getTranspositionTable().isPrivate()) {
+    searchThreads.clearHash();
+  }
 }
 
 void UciInterface::handlePositionCommand(const std::vector<std::string>& tokens) {
@@ -102,11 +155,12 @@ void UciInterface::handlePositionCommand(const std::vector<std::string>& tokens)
     return;
   }
   
+  searchThreads.waitForSearchFinished();
   size_t moveTokenIndex = 0;
   
   if (tokens[1] == "startpos") {
     chessBoard.load_fen(start_position);
-    searchEngine.resetRepetitionTable();
+    searchThreads.resetRepetitionTable();
     moveTokenIndex = 3;
   } else if (tokens[1] == "fen" && tokens.size() >= 8) {
     std::string fenString;
@@ -115,7 +169,7 @@ void UciInterface::handlePositionCommand(const std::vector<std::string>& tokens)
       fenString += tokens[i];
     }
     chessBoard.load_fen(fenString);
-    searchEngine.resetRepetitionTable();
+    searchThreads.resetRepetitionTable();
     moveTokenIndex = 9;
   }
   
@@ -139,12 +193,15 @@ void UciInterface::handleGoCommand(const std::vector<std::string>& tokens) {
   int64_t movesToGo = 0;
   int searchDepth = DEFAULT_SEARCH_DEPTH;
   bool infiniteSearch = false;
+  bool ponderSearch = false;
   
   for (size_t i = 1; i < tokens.size(); ++i) {
     const std::string& token = tokens[i];
     
     if (token == "infinite") {
       infiniteSearch = true;
+    } else if (token == "ponder") {
+      ponderSearch = true;
     } else if (i + 1 < tokens.size()) {
       const std::string& value = tokens[i + 1];
       
@@ -179,15 +236,136 @@ void UciInterface::handleGoCommand(const std::vector<std::string>& tokens) {
                                                         playerIncrement, opponentIncrement, 
                                                         movesToGo, infiniteSearch);
   
-  searchEngine.setTimeLimit(timeAllocation);
-  std::cout << "time_alloted: " << timeAllocation << "\n";
+  SearchLimits limits;
+  limits.depth = searchDepth;
+  limits.timeAllocated = timeAllocation;
+  limits.infinite = infiniteSearch;
+  limits.ponder = ponderSearch;
   
-  searchEngine.findBestMove(chessBoard, searchDepth);
-  chessBoard.print();
+  std::cout << "time_alloted: " << timeAllocation << std::endl;
+  
+  searchThreads.startThinking(chessBoard, limits);
 }
 
 void UciInterface::handleStopCommand() {
-  searchEngine.stopSearch();
+  searchThreads.stopSearch();
+}
+
+void UciInterface::handlePonderHitCommand() {
+  searchThreads.ponderhit();
+}
+
+void UciInterface::handleSetOptionCommand(const std::vector<std::string>& tokens) {
+  auto nameIterator = std::find(tokens.begin(), tokens.end(), "name");
+  auto valueIterator = std::find(tokens.begin(), tokens.end(), "value");
+  
+  if (nameIterator == tokens.end() || std::next(nameIterator) == tokens.end()) {
+    return;
+  }
+  
+  std::string name;
+  for (auto it = std::next(nameIterator); it != valueIterator && it != tokens.end(); ++it) {
+    if (!name.empty()) name += " ";
+    name += *it;
+  }
+  
+  std::string value;
+  if (valueIterator != tokens.end()) {
+    for (auto it = std::next(valueIterator); it != tokens.end(); ++it) {
+      if (!value.empty()) value += " ";
+      value += *it;
+    }
+  }
+  
+  searchThreads.waitForSearchFinished();
+  
+  if (name == "Threads" && !value.empty()) {
+    searchThreads.setThreadCount(std::stoi(value));
+    const int nodes = NumaTopology::system().nodeCount();
+    if (nodes > 1) {
+      std::lock_guard<std::mutex> lock(outputMutex());
+      std::cout << "info string " << searchThreads.size() << " search threads bound to " << nodes
+                << " NUMA nodes" << std::endl;
+    }
+  } else if (name == "Hash" && !value.empty()) {
+    // A new size always means a private table again.
+    const std::string detached = searchThreads.getTranspositionTable().sharedSegment();
+    hashSizeMB = std::stoi(value);
+    const int sizeInMB = searchThreads.setHashSize(hashSizeMB);
+    std::lock_guard<std::mutex> lock(outputMutex());
+    if (!detached.empty()) {
+      std::cout << "info string Detached from shared hash " << detached << std::endl;
+    }
+    printHashInfo(sizeInMB);
+  } else if (name == "MultiPV" && !value.empty()) {
+    searchThreads.setMultiPV(std::stoi(value));
+  } else if (name == "EvalFile" && !value.empty()) {
+    // The search threads rebuild their accumulators at the next "go".
+    std::lock_guard<std::mutex> lock(outputMutex());
+    if (nnue_init(value.c_str())) {
+      // The evals kept in the table belong to the previous network. A loaded
+      // or shared table is left alone: other processes may still be using it.
+      if (searchThreads.getTranspositionTable().isPrivate()) {
+        searchThreads.clearHash();
+      }
+      printNetworkInfo(value);
+    } else {
+      std::cout << "info string Could not load " << value << ", keeping "
+                << nnue_network_name() << std::endl;
+    }
+  } else if (name == "HashFile" && !value.empty()) {
+    hashFile = value;
+  } else if (name == "SaveHash") {
+    TranspositionTable& table = searchThreads.getTranspositionTable();
+    std::lock_guard<std::mutex> lock(outputMutex());
+    if (table.save(hashFile)) {
+      std::cout << "info string Saved " << table.size() << " hash entries to " << hashFile << std::endl;
+    } else {
+      std::cout << "info string Could not save the hash to " << hashFile << std::endl;
+    }
+  } else if (name == "LoadHash") {
+    // Takes the size of the saved table until Hash is set again.
+    TranspositionTable& table = searchThreads.getTranspositionTable();
+    std::lock_guard<std::mutex> lock(outputMutex());
+    if (table.load(hashFile)) {
+      std::cout << "info string Loaded " << table.size() << " hash entries from " << hashFile << std::endl;
+    } else {
+      std::cout << "info string Could not load the hash from " << hashFile << ", keeping the current one" << std::endl;
+    }
+  } else if (name == "SharedHash" && (value.empty() || value == "<empty>")) {
+    // Detaches from a shared table and goes back to a private one of the
+    // Hash size.
+    const std::string detached = searchThreads.getTranspositionTable().sharedSegment();
+    if (!detached.empty()) {
+      const int sizeInMB = searchThreads.setHashSize(hashSizeMB);
+      std::lock_guard<std::mutex> lock(outputMutex());
+      std::cout << "info string Detached from shared hash " << detached << std::endl;
+      printHashInfo(sizeInMB);
+    }
+  } else if (name == "SharedHash") {
+    TranspositionTable& table = searchThreads.getTranspositionTable();
+    sharedHashName = value;
+    std::lock_guard<std::mutex> lock(outputMutex());
+    if (table.attachShared(value)) {
+      std::cout << "info string Sharing " << table.size() << " hash entries through " << value << std::endl;
+    } else {
+      std::cout << "info string Could not attach to shared hash " << value << ", keeping the current one" << std::endl;
+    }
+  } else if (name == "UnlinkSharedHash") {
+    // Also clears out a segment whose creator died before setting it up.
+    std::lock_guard<std::mutex> lock(outputMutex());
+    if (TranspositionTable::unlinkShared(sharedHashName)) {
+      std::cout << "info string Removed shared hash " << sharedHashName
+                << ", attached processes keep it until they detach" << std::endl;
+    } else {
+      std::cout << "info string No shared hash to remove" << std::endl;
+    }
+  } else if (name == "Ponder") {
+    // Pondering is driven entirely by "go ponder" / "ponderhit".
+  } else {
+    std::lock_guard<std::mutex> lock(outputMutex());
+    std::cout << "Unknown option: " << name << std::endl;
+  }
 }
 
 void UciInterface::runGameLoop() {
@@ -216,8 +394,17 @@ void UciInterface::runGameLoop() {
       handleGoCommand(tokens);
     } else if (command == "stop") {
       handleStopCommand();
+    } else if (command == "ponderhit") {
+      handlePonderHitCommand();
+    } else if (command == "setoption") {
+      handleSetOptionCommand(tokens);
     } else {
+      std::lock_guard<std::mutex> lock(outputMutex());
       std::cout << "Unknown command: " << inputLine << std::endl;
     }
   }
+  
+  // Reached on "quit" and on end of input alike: abort any running search.
+  searchThreads.stopSearch();
+  searchThreads.waitForSearchFinished();
 }
\ No newline at end of file
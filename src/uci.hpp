@@ -2,7 +2,7 @@
 
 #include "board.hpp"
 #include "time.hpp"
-#include "search.hpp"
+#include "thread_pool.hpp"
 #include <string>
 #include <vector>
 
@@ -20,8 +20,20 @@ private:
   static constexpr int64_t EMERGENCY_TIME_DIVISOR = 10;
   static constexpr int64_t MAXIMUM_EMERGENCY_TIME = 5000;
   
+  static constexpr int DEFAULT_THREADS = 1;
+  static constexpr int DEFAULT_MULTI_PV = 1;
+  static constexpr int DEFAULT_HASH_MB = 64;
+  static constexpr const char* DEFAULT_HASH_FILE = "hash.bin";
+  
   Board chessBoard;
-  ChessSearch searchEngine;
+  ThreadPool searchThreads;
+  std::string hashFile = DEFAULT_HASH_FILE;
+  int hashSizeMB = DEFAULT_HASH_MB;
+  bool hashReported = false;
+  bool defaultNetworkLoaded = false;
+  bool networkReported = false;
+  // Last name given to SharedHash, whether or not attaching to it worked
+  std::string sharedHashName;
   
   std::vector<std::string> splitString(const std::string& input, char delimiter) const;
   
@@ -31,6 +43,10 @@ private:
   void handlePositionCommand(const std::vector<std::string>& tokens);
   void handleGoCommand(const std::vector<std::string>& tokens);
   void handleStopCommand();
+  void handlePonderHitCommand();
+  void handleSetOptionCommand(const std::vector<std::string>& tokens);
+  void printHashInfo(int sizeInMB);
+  void printNetworkInfo(const std::string& evalFile);
   
   void parseAndMakeMove(const std::string& moveString);
   std::string moveToString(const Move& move) const;
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""Local test of SharedHash with two engine processes on one host.
+
+Searches a position to a fixed depth:
+  1. in an engine with a private table, as the baseline,
+  2. in an engine attached to a new shared segment, which matches it,
+  3. in a second engine attached to the same segment, which finds most of
+     the tree already there,
+then searches another position in both engines at once, where the shared
+table makes the node counts vary from run to run.
+Prints nodes and time for each. Fails if the second engine does not
+search fewer nodes than the first, or if the segment's generation did not
+count the searches of both engines.
+
+  tools/shared_hash_test.py [engine] [--eval-file FILE] [--depth N] [--hash MB]
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import threading
+import time
+
+POSITION = "position fen rnbqkb1r/pp1p1ppp/4pn2/2p5/2PP4/5N2/PP2PPPP/RNBQKB1R w KQkq - 0 4"
+CONCURRENT_POSITION = "position fen r1bqkbnr/pppp1ppp/2n5/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R w KQkq - 2 3"
+# Byte offset of the generation in the segment header, after the magic,
+# version, cluster size and cluster count
+GENERATION_OFFSET = 24
+GENERATION_DELTA = 4
+
+
+class Engine:
+    def __init__(self, path, options):
+        self.process = subprocess.Popen([path], stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                        text=True, bufsize=1)
+        self.strings = []
+        for name, value in options:
+            self.send(f"setoption name {name}" + (f" value {value}" if value is not None else ""))
+        self.send("isready")
+        self.read_until("readyok")
+
+    def send(self, command):
+        self.process.stdin.write(command + "\n")
+        self.process.stdin.flush()
+
+    def read_until(self, prefix):
+        for line in self.process.stdout:
+            if line.startswith("info string"):
+                self.strings.append(line.strip())
+            if line.startswith(prefix):
+                return line
+        raise RuntimeError(f"engine exited before {prefix!r}")
+
+    def search(self, depth, position=POSITION):
+        self.send(position)
+        start = time.time()
+        self.send(f"go depth {depth}")
+        nodes = 0
+        for line in self.process.stdout:
+            if " nodes " in line:
+                nodes = int(line.split(" nodes ")[1].split()[0])
+            if line.startswith("bestmove"):
+                return nodes, time.time() - start
+        raise RuntimeError("engine exited before bestmove")
+
+    def quit(self):
+        self.send("quit")
+        self.process.wait()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("engine", nargs="?", default="./my_chess.exe")
+    parser.add_argument("--eval-file")
+    parser.add_argument("--depth", type=int, default=8)
+    parser.add_argument("--hash", type=int, default=128)
+    args = parser.parse_args()
+
+    segment = f"shared_hash_test_{os.getpid()}"
+    options = [("Hash", args.hash)]
+    if args.eval_file:
+        options.append(("EvalFile", args.eval_file))
+    shared_options = options + [("SharedHash", segment)]
+
+    def report(label, nodes, seconds):
+        print(f"{label:24s} {nodes:10d} nodes {seconds * 1000:8.0f} ms")
+
+    engine = Engine(args.engine, options)
+    baseline, seconds = engine.search(args.depth)
+    engine.quit()
+    report("private", baseline, seconds)
+
+    engines = []
+    for index in range(2):
+        engine = Engine(args.engine, shared_options)
+        if not any(line.startswith("info string Sharing") for line in engine.strings):
+            print("could not attach:", engine.strings)
+            return 1
+        engines.append(engine)
+    first, first_seconds = engines[0].search(args.depth)
+    report("shared, first engine", first, first_seconds)
+    second, second_seconds = engines[1].search(args.depth)
+    report("shared, second engine", second, second_seconds)
+
+    results = [None] * len(engines)
+
+    def run(index):
+        results[index] = engines[index].search(args.depth, CONCURRENT_POSITION)
+
+    threads = [threading.Thread(target=run, args=(i,)) for i in range(len(engines))]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    for index, (nodes, seconds) in enumerate(results):
+        report(f"shared, concurrent #{index + 1}", nodes, seconds)
+
+    generation = None
+    shm_path = f"/dev/shm/{segment}"
+    if os.path.exists(shm_path):
+        with open(shm_path, "rb") as segment_file:
+            generation = segment_file.read(GENERATION_OFFSET + 1)[GENERATION_OFFSET]
+
+    engines[0].send("setoption name UnlinkSharedHash")
+    engines[0].send("isready")
+    engines[0].read_until("readyok")
+    for engine in engines:
+        engine.quit()
+
+    ok = True
+    if second >= first:
+        print(f"FAIL: the second engine searched {second} nodes, the first one {first}")
+        ok = False
+    if generation is not None:
+        expected = (GENERATION_DELTA * 4) & 0xFF
+        print(f"segment generation {generation}, expected {expected} after four searches")
+        ok = ok and generation == expected
+    print("ok" if ok else "FAIL")
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+"""Checks that an engine stopped right after "go" still answers with a legal
+bestmove.
+
+For every position the legal moves are first listed with a depth 1 search
+that shows all of them as MultiPV lines. Then "go infinite" is followed at
+once by "stop", and "go" at once by "quit", with one and with several
+threads, and every bestmove has to be one of those moves.
+
+  tools/stop_test.py [engine] [--eval-file FILE] [--repeat N]
+"""
+
+import argparse
+import subprocess
+import sys
+
+POSITIONS = [
+    "startpos",
+    "startpos moves e2e4 e7e5 g1f3 b8c6 f1b5 a7a6",
+    # In check: only evasions are legal
+    "fen rnbqkbnr/ppp2ppp/8/1B1pp3/4P3/8/PPPP1PPP/RNBQK1NR b KQkq - 1 3",
+    "fen 8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+]
+MAX_MULTI_PV = 256
+
+
+def run(engine, commands):
+    """Feeds commands to a fresh engine and returns its output lines."""
+    result = subprocess.run([engine], input="\n".join(commands) + "\n", capture_output=True,
+                            text=True, timeout=60)
+    return result.stdout.splitlines()
+
+
+def legal_moves(engine, setup, position):
+    process = subprocess.Popen([engine], stdin=subprocess.PIPE, stdout=subprocess.PIPE, text=True)
+    process.stdin.write("\n".join(setup + [f"setoption name MultiPV value {MAX_MULTI_PV}",
+                                           f"position {position}", "go depth 1"]) + "\n")
+    process.stdin.flush()
+    moves = set()
+    for line in process.stdout:
+        if line.startswith("info") and " multipv " in line and " pv " in line:
+            moves.add(line.split(" pv ")[1].split()[0])
+        if line.startswith("bestmove"):
+            break
+    process.stdin.write("quit\n")
+    process.stdin.flush()
+    process.wait()
+    return moves
+
+
+def bestmove(lines):
+    for line in lines:
+        if line.startswith("bestmove"):
+            return line.split()[1]
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("engine", nargs="?", default="./my_chess.exe")
+    parser.add_argument("--eval-file")
+    parser.add_argument("--repeat", type=int, default=5)
+    args = parser.parse_args()
+
+    setup = [f"setoption name EvalFile value {args.eval_file}"] if args.eval_file else []
+    failures = 0
+    for position in POSITIONS:
+        legal = legal_moves(args.engine, setup, position)
+        if not legal:
+            print(f"FAIL: no legal moves listed for {position}")
+            failures += 1
+            continue
+
+        for threads in (1, 4):
+            options = setup + [f"setoption name Threads value {threads}", "isready", f"position {position}"]
+            for _ in range(args.repeat):
+                for label, commands in (("go infinite, stop", ["go infinite", "stop", "isready"]),
+                                        ("go, quit", ["go depth 30", "quit"])):
+                    move = bestmove(run(args.engine, options + commands))
+                    if move not in legal:
+                        print(f"FAIL: {label} with {threads} threads on {position}: bestmove {move}")
+                        failures += 1
+
+    print("ok" if failures == 0 else f"FAIL: {failures} illegal replies")
+    return 0 if failures == 0 else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
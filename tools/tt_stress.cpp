@@ -0,0 +1,88 @@
+// Stress test for the lock-free transposition table: many threads store and
+// probe the same small set of positions, and every hit is checked against
+// the values that position is always stored with. A torn entry that slips
+// past the key check shows up as a corrupted hit.
+//
+//   tt_stress [threads] [operations per thread]
+
+#include "transposition_table.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+  constexpr size_t KEY_COUNT = 40000;
+
+  // The fields a key is always stored with
+  int scoreOf(uint64_t key) { return static_cast<int>(key % 40001) - 20000; }
+  uint16_t moveOf(uint64_t key) { return static_cast<uint16_t>((key >> 20) | 1); }
+  int evalOf(uint64_t key) { return static_cast<int>((key >> 40) % 30001) - 15000; }
+  int depthOf(uint64_t key) { return static_cast<int>(key % 60); }
+
+  // Keys that all land in different slots of a table with the given number
+  // of clusters, so that a hit can only be the key's own entry
+  std::vector<uint64_t> distinctKeys(size_t clusters) {
+    std::mt19937_64 rng(7);
+    std::vector<uint64_t> keys;
+    std::set<std::pair<size_t, uint16_t>> seen;
+    while (keys.size() < KEY_COUNT) {
+      const uint64_t key = rng();
+      const size_t cluster = static_cast<size_t>((static_cast<unsigned __int128>(key) * clusters) >> 64);
+      if (seen.insert({cluster, static_cast<uint16_t>(key)}).second) {
+        keys.push_back(key);
+      }
+    }
+    return keys;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  const int threadCount = argc > 1 ? std::atoi(argv[1]) : 8;
+  const long operations = argc > 2 ? std::atol(argv[2]) : 4000000;
+
+  TranspositionTable table(1);
+  const std::vector<uint64_t> keys = distinctKeys(table.size() / TranspositionCluster::ENTRY_COUNT);
+
+  std::atomic<long> probes{0}, hits{0}, corrupted{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadCount; ++t) {
+    threads.emplace_back([&, t] {
+      std::mt19937_64 rng(t);
+      long threadProbes = 0, threadHits = 0, threadCorrupted = 0;
+      for (long i = 0; i < operations; ++i) {
+        const uint64_t key = keys[rng() % keys.size()];
+        if (rng() & 1) {
+          table.store(scoreOf(key), depthOf(key), HashFlag::EXACT, key, 0, moveOf(key), evalOf(key));
+          continue;
+        }
+
+        TranspositionData data;
+        ++threadProbes;
+        if (!table.probe(key, 0, data)) {
+          continue;
+        }
+        ++threadHits;
+        if (data.score != scoreOf(key) || data.move != moveOf(key) || data.eval != evalOf(key) ||
+            data.depth != depthOf(key) || data.flag != HashFlag::EXACT) {
+          ++threadCorrupted;
+        }
+      }
+      probes += threadProbes;
+      hits += threadHits;
+      corrupted += threadCorrupted;
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  std::printf("threads %d probes %ld hits %ld corrupted %ld\n", threadCount, probes.load(), hits.load(),
+              corrupted.load());
+  return corrupted.load() == 0 ? 0 : 1;
+}